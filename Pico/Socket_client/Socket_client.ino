@@ -6,6 +6,8 @@ const char *password = "WiFi Passport";
 const char *server = "Server IP";
 const uint16_t port = "Server Port";
 const int VIBRATION = 6;//<-- GPIO6 在左邊第二個GND下第一個PIN
+// 連線後向 server 訂閱：只收這個感測器 >= 1000 的警告，其他事件 server 不會送過來
+const char *subscription = "SUB sensors=sensor_noise_001 min=1000 kinds=alert\n";
 
 WiFiClient wifi;
 
@@ -38,21 +40,26 @@ void setup() {
     delay(500);
   }
   Serial.println("Server connected successful");  
+  wifi.print(subscription);
 }
 
 void loop() {
   while(wifi.available()) {
-    String c = wifi.readStringUntil('\0');
-    float val = c.toFloat();
-    if (val >= 1000){
-      Serial.print("Server sends alert value: ");
-      Serial.println(val);
-      Serial.println("LED 亮起來 示意 震動馬達震動");
-      Serial.println("10秒後自動停止");
-      analogWrite(VIBRATION, 255 / 5 * 3);
-      delay(10000);
-      analogWrite(VIBRATION, 0);
+    // 每行一個事件："alert <sensor> <value>"，server 已經過濾過數值
+    String c = wifi.readStringUntil('\n');
+    if (!c.startsWith("alert ")){
+      if (c.startsWith("ERR"))
+        Serial.println("Server rejected subscription: " + c);
+      continue;
     }
+    float val = c.substring(c.lastIndexOf(' ') + 1).toFloat();
+    Serial.print("Server sends alert value: ");
+    Serial.println(val);
+    Serial.println("LED 亮起來 示意 震動馬達震動");
+    Serial.println("10秒後自動停止");
+    analogWrite(VIBRATION, 255 / 5 * 3);
+    delay(10000);
+    analogWrite(VIBRATION, 0);
   }
   if (!wifi.connected()) {
     Serial.println();
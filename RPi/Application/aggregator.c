@@ -0,0 +1,487 @@
+    /*
+     * aggregator：接收多台 gateway (server -u) 上傳的 batch，批次寫入 MariaDB。
+     * 每台 gateway 一條連線，frame 格式見 uplink.h。
+     * -o FILE 改寫成 CSV (gateway,device_id,value,status)，不需要資料庫也能單機測試。
+     *
+     * 去重用的 (gateway, session, last_seq) 和資料一起寫入，重啟後讀回來：
+     *   MariaDB：同一個 transaction 內寫 sensor_data 與 uplink_state
+     *   CSV：每個 batch 後面接一行 "#uplink,<gateway>,<session>,<last_seq>"，
+     *        啟動時讀回最後的狀態，並截掉最後一行標記之後不完整的 batch
+     */
+    #include <sys/types.h>
+    #include <sys/socket.h>
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <netinet/in.h>
+    #include <arpa/inet.h>
+    #include <sys/time.h>
+    #include <unistd.h>
+    #include <string.h>
+    #include <fcntl.h>
+    #include <errno.h>
+    #include <signal.h>
+    #include <sys/stat.h>
+    #include <inttypes.h>
+    #include <mariadb/mysql.h>
+    #include <zlib.h>
+
+    #include "uplink.h"
+
+    #define MAX_GATEWAYS 64
+    #define MAX_BATCH_RECORDS 4096
+
+    struct gateway_state {
+        char id[32];
+        uint64_t session;
+        uint32_t last_seq;     // 已寫入的最後序號
+        unsigned long records;
+    };
+
+    struct conn {
+        int gw;                // gateways[] 的 index，還沒 HELLO 前是 -1
+        unsigned char *buf;
+        size_t len, cap;
+    };
+
+    static MYSQL *conn;
+    static char mysql_ip[] = "Database_IP";
+    static char mysql_username[] = "Database_Username";
+    static char mysql_password[] = "Database_Password";
+    static char mysql_dbname[] = "Database_Name";
+    static int connect_status = 0;
+    static int state_loaded = 0;   // uplink_state 已經從資料庫讀回來
+
+    static FILE *sink_fp = NULL;   // -o: 資料庫替身
+    static int sink_persist = 0;   // -o 是一般檔案，去重狀態存在檔案裡 (stdout 沒有)
+    static struct gateway_state gateways[MAX_GATEWAYS];
+    static int gateway_count = 0;
+    static struct conn conns[FD_SETSIZE];
+    static volatile sig_atomic_t stop_flag = 0;
+
+    void handle_sigint(int sig) {
+        stop_flag = 1;
+    }
+
+    int open_connect(){
+        unsigned int timeout = 3, io_timeout = 2;
+
+        conn = mysql_init(NULL);
+        if (!conn) {
+            fprintf(stderr, "MySQL init error\n");
+            return -1;
+        }
+        mysql_options(conn, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+        mysql_options(conn, MYSQL_OPT_READ_TIMEOUT, &io_timeout);
+        mysql_options(conn, MYSQL_OPT_WRITE_TIMEOUT, &io_timeout);
+        if (!mysql_real_connect(conn, mysql_ip, mysql_username, mysql_password, mysql_dbname, 0, NULL, 0)) {
+            fprintf(stderr, "MySQL connection error: %s\n", mysql_error(conn));
+            mysql_close(conn);
+            return -1;
+        }
+        connect_status = 1;
+        return 0;
+    }
+
+    int close_connect(){
+        if (connect_status)
+            mysql_close(conn);
+        connect_status = 0;
+        return 0;
+    }
+
+    /* 依 id 找 gateway，沒有就新增一個；表滿了回傳 -1 */
+    static int gateway_get(const char *id) {
+        for (int i = 0; i < gateway_count; i++) {
+            if (strncmp(gateways[i].id, id, sizeof(gateways[i].id)) == 0)
+                return i;
+        }
+        if (gateway_count == MAX_GATEWAYS)
+            return -1;
+        memset(&gateways[gateway_count], 0, sizeof(gateways[gateway_count]));
+        snprintf(gateways[gateway_count].id, sizeof(gateways[gateway_count].id), "%.31s", id);
+        return gateway_count++;
+    }
+
+    static void state_restore(const char *id, uint64_t session, uint32_t last_seq) {
+        int i = gateway_get(id);
+
+        if (i < 0)
+            return;
+        gateways[i].session = session;
+        gateways[i].last_seq = last_seq;
+    }
+
+    /* 從資料庫讀回去重狀態，只在第一次連上時做一次 */
+    static int state_load_db(void) {
+        MYSQL_RES *res;
+        MYSQL_ROW row;
+
+        if (mysql_query(conn, "CREATE TABLE IF NOT EXISTS uplink_state ("
+                "gateway_id VARCHAR(32) PRIMARY KEY, session BIGINT UNSIGNED NOT NULL, last_seq INT UNSIGNED NOT NULL)") ||
+            mysql_query(conn, "SELECT gateway_id, session, last_seq FROM uplink_state")) {
+            fprintf(stderr, "uplink_state: %s\n", mysql_error(conn));
+            return -1;
+        }
+        res = mysql_store_result(conn);
+        if (!res)
+            return -1;
+        while ((row = mysql_fetch_row(res)) != NULL)
+            state_restore(row[0], strtoull(row[1], NULL, 10), strtoul(row[2], NULL, 10));
+        mysql_free_result(res);
+        state_loaded = 1;
+        printf("[INFO] restored dedup state of %d gateway(s) from MariaDB\n", gateway_count);
+        return 0;
+    }
+
+    /*
+     * 開啟 -o 的檔案，讀回每個 gateway 最後的 #uplink 標記，
+     * 並截掉最後一個標記之後的資料 (寫到一半就當掉的 batch，gateway 會重送)。
+     */
+    static FILE *state_load_file(const char *path) {
+        FILE *fp = fopen(path, "a+");
+        char line[256], id[33];
+        long good_end = 0, pos = 0;
+        int markers = 0;
+        uint64_t session;
+        uint32_t last_seq;
+
+        if (!fp)
+            return NULL;
+        rewind(fp);
+        while (fgets(line, sizeof(line), fp)) {
+            pos = ftell(fp);
+            if (sscanf(line, "#uplink,%32[^,],%" SCNu64 ",%" SCNu32, id, &session, &last_seq) == 3) {
+                state_restore(id, session, last_seq);
+                good_end = pos;
+                markers++;
+            }
+        }
+        // 沒有任何標記的舊檔案整個保留
+        if (markers == 0)
+            good_end = pos;
+        if (pos > good_end) {
+            fprintf(stderr, "[WARN] %s: dropping %ld byte(s) of an unfinished batch\n", path, pos - good_end);
+            fflush(fp);
+            if (ftruncate(fileno(fp), good_end) != 0)
+                perror(path);
+        }
+        printf("[INFO] restored dedup state of %d gateway(s) from %s\n", gateway_count, path);
+        return fp;
+    }
+
+    /* HELLO 之前去重狀態要先讀回來，否則 WELCOME 會回報錯的序號 */
+    static int sink_ready(void) {
+        if (sink_fp)
+            return 0;
+        if (connect_status && mysql_ping(conn))
+            close_connect();
+        if (!connect_status && open_connect() != 0)
+            return -1;
+        return state_loaded ? 0 : state_load_db();
+    }
+
+    /*
+     * 一個 batch 用一條多筆 INSERT 寫入，並在同一個 transaction 內更新 uplink_state；
+     * 失敗回傳 -1，不回 ACK 讓 gateway 重送。
+     */
+    int sink_write(const struct gateway_state *gw, uint32_t seq, const struct db_record *recs, int count) {
+        if (sink_fp) {
+            for (int i = 0; i < count; i++)
+                fprintf(sink_fp, "%s,%.32s,%.32s,%.16s\n", gw->id, recs[i].device_id, recs[i].value, recs[i].status);
+            if (sink_persist)
+                fprintf(sink_fp, "#uplink,%s,%" PRIu64 ",%" PRIu32 "\n", gw->id, gw->session, seq);
+            if (fflush(sink_fp) != 0 || (sink_persist && fsync(fileno(sink_fp)) != 0))
+                return -1;
+            return 0;
+        }
+
+        if (sink_ready() != 0)
+            return -1;
+
+        // 每筆欄位跳脫後最多 2*n+1，加上引號與逗號
+        size_t cap = 128 + (size_t)count * (2 * sizeof(recs[0]) + 16);
+        char *query = malloc(cap);
+        char state[256], gw_id[2 * sizeof(gw->id) + 1];
+        if (!query)
+            return -1;
+        size_t len = snprintf(query, cap, "INSERT INTO sensor_data (device_id, value, status) VALUES ");
+        for (int i = 0; i < count; i++) {
+            char dev[2 * sizeof(recs[i].device_id) + 1], val[2 * sizeof(recs[i].value) + 1], st[2 * sizeof(recs[i].status) + 1];
+            mysql_real_escape_string(conn, dev, recs[i].device_id, strnlen(recs[i].device_id, sizeof(recs[i].device_id)));
+            mysql_real_escape_string(conn, val, recs[i].value, strnlen(recs[i].value, sizeof(recs[i].value)));
+            mysql_real_escape_string(conn, st, recs[i].status, strnlen(recs[i].status, sizeof(recs[i].status)));
+            len += snprintf(query + len, cap - len, "%s('%s', '%s', '%s')", i ? ", " : "", dev, val, st);
+        }
+        mysql_real_escape_string(conn, gw_id, gw->id, strnlen(gw->id, sizeof(gw->id)));
+        snprintf(state, sizeof(state),
+            "INSERT INTO uplink_state (gateway_id, session, last_seq) VALUES ('%s', %" PRIu64 ", %" PRIu32 ") "
+            "ON DUPLICATE KEY UPDATE session = VALUES(session), last_seq = VALUES(last_seq)", gw_id, gw->session, seq);
+
+        int ret = 0;
+        if (mysql_query(conn, "START TRANSACTION") || mysql_query(conn, query) ||
+            mysql_query(conn, state) || mysql_query(conn, "COMMIT")) {
+            fprintf(stderr, "Insert error: %s\n", mysql_error(conn));
+            mysql_query(conn, "ROLLBACK");
+            ret = -1;
+        }
+        free(query);
+        return ret;
+    }
+
+    static int write_all(int fd, const void *buf, size_t len) {
+        const char *p = buf;
+        while (len > 0) {
+            ssize_t n = write(fd, p, len);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return -1;
+            p += n;
+            len -= n;
+        }
+        return 0;
+    }
+
+    static int send_frame(int fd, uint8_t type, uint32_t seq) {
+        struct uplink_header hdr;
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = htonl(UPLINK_MAGIC);
+        hdr.type = type;
+        hdr.seq = htonl(seq);
+        return write_all(fd, &hdr, sizeof(hdr));
+    }
+
+    static int find_gateway(const struct uplink_hello *hello) {
+        char id[sizeof(hello->gateway_id) + 1];
+        int i;
+
+        memcpy(id, hello->gateway_id, sizeof(hello->gateway_id));
+        id[sizeof(hello->gateway_id)] = '\0';
+        i = gateway_get(id);
+        // gateway 重新啟動，序號從頭開始
+        if (i >= 0 && gateways[i].session != hello->session) {
+            gateways[i].session = hello->session;
+            gateways[i].last_seq = 0;
+        }
+        return i;
+    }
+
+    /* 處理一個完整的 frame；回傳 -1 表示要關掉這條連線 */
+    static int handle_frame(int fd, struct conn *c, const struct uplink_header *hdr, const unsigned char *payload) {
+        static struct db_record recs[MAX_BATCH_RECORDS];
+        struct gateway_state *gw;
+        uLongf raw_len;
+
+        switch (hdr->type) {
+        case UPLINK_HELLO:
+            if (hdr->payload_len != sizeof(struct uplink_hello))
+                return -1;
+            if (sink_ready() != 0) {
+                // 還不知道已寫入的序號，先斷線讓 gateway 稍後重連
+                fprintf(stderr, "sink not ready, refusing gateway on fd %d\n", fd);
+                return -1;
+            }
+            c->gw = find_gateway((const struct uplink_hello *)payload);
+            if (c->gw < 0) {
+                fprintf(stderr, "too many gateways\n");
+                return -1;
+            }
+            gw = &gateways[c->gw];
+            printf("gateway %s connected on fd %d, last seq %u\n", gw->id, fd, gw->last_seq);
+            return send_frame(fd, UPLINK_WELCOME, gw->last_seq);
+
+        case UPLINK_BATCH:
+            if (c->gw < 0)
+                return -1;
+            gw = &gateways[c->gw];
+            // 重送的 batch 已經寫過了，只回 ACK
+            if (hdr->seq <= gw->last_seq)
+                return send_frame(fd, UPLINK_ACK, gw->last_seq);
+
+            if (hdr->count > MAX_BATCH_RECORDS || hdr->raw_len != hdr->count * sizeof(struct db_record))
+                return -1;
+            raw_len = hdr->raw_len;
+            if (uncompress((Bytef *)recs, &raw_len, payload, hdr->payload_len) != Z_OK || raw_len != hdr->raw_len) {
+                fprintf(stderr, "gateway %s: corrupt batch %u\n", gw->id, hdr->seq);
+                return -1;
+            }
+            if (sink_write(gw, hdr->seq, recs, hdr->count) != 0) {
+                // 寫不進去就斷線，gateway 重連後會從 last_seq 之後重送
+                fprintf(stderr, "gateway %s: batch %u not stored, dropping connection\n", gw->id, hdr->seq);
+                return -1;
+            }
+            gw->last_seq = hdr->seq;
+            gw->records += hdr->count;
+            printf("gateway %s: batch %u, %u records (%u -> %u bytes), %lu total\n",
+                gw->id, hdr->seq, hdr->count, hdr->payload_len, hdr->raw_len, gw->records);
+            return send_frame(fd, UPLINK_ACK, gw->last_seq);
+
+        default:
+            return -1;
+        }
+    }
+
+    /* 讀進來的資料可能不只一個 frame，也可能不完整 */
+    static int handle_readable(int fd) {
+        struct conn *c = &conns[fd];
+        struct uplink_header hdr;
+
+        if (c->cap - c->len < 4096) {
+            size_t cap = c->cap ? c->cap * 2 : 8192;
+            unsigned char *p;
+            if (cap > sizeof(hdr) + UPLINK_MAX_PAYLOAD + 4096)
+                return -1;
+            p = realloc(c->buf, cap);
+            if (!p)
+                return -1;
+            c->buf = p;
+            c->cap = cap;
+        }
+        ssize_t n = read(fd, c->buf + c->len, c->cap - c->len);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            return 0;
+        if (n <= 0)
+            return -1;
+        c->len += n;
+
+        while (c->len >= sizeof(hdr)) {
+            memcpy(&hdr, c->buf, sizeof(hdr));
+            hdr.magic = ntohl(hdr.magic);
+            hdr.seq = ntohl(hdr.seq);
+            hdr.count = ntohl(hdr.count);
+            hdr.raw_len = ntohl(hdr.raw_len);
+            hdr.payload_len = ntohl(hdr.payload_len);
+            if (hdr.magic != UPLINK_MAGIC || hdr.payload_len > UPLINK_MAX_PAYLOAD)
+                return -1;
+            if (c->len < sizeof(hdr) + hdr.payload_len)
+                break;
+            if (handle_frame(fd, c, &hdr, c->buf + sizeof(hdr)) < 0)
+                return -1;
+            c->len -= sizeof(hdr) + hdr.payload_len;
+            memmove(c->buf, c->buf + sizeof(hdr) + hdr.payload_len, c->len);
+        }
+        return 0;
+    }
+
+    static void close_conn(int fd, fd_set *readfds) {
+        if (conns[fd].gw >= 0)
+            printf("gateway %s disconnected\n", gateways[conns[fd].gw].id);
+        close(fd);
+        FD_CLR(fd, readfds);
+        free(conns[fd].buf);
+        memset(&conns[fd], 0, sizeof(conns[fd]));
+        conns[fd].gw = -1;
+    }
+
+    void usage(const char *prog) {
+        fprintf(stderr,
+            "Usage: %s [-p port] [-o file]\n"
+            "  -p port  port gateways connect to (default %d)\n"
+            "  -o file  append rows as CSV instead of writing to MariaDB ('-' = stdout,\n"
+            "           without the dedup state, so duplicates are possible after a restart)\n",
+            prog, UPLINK_PORT);
+    }
+
+    int main(int argc, char *argv[]){
+        int server_sockfd, client_sockfd, fd, opt, reuse = 1;
+        int port = UPLINK_PORT;
+        struct sockaddr_in server_address, client_address;
+        socklen_t client_len;
+        fd_set readfds, testfds;
+        struct sigaction sa;
+
+        while ((opt = getopt(argc, argv, "p:o:h")) != -1) {
+            switch (opt) {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'o':
+                sink_persist = strcmp(optarg, "-") != 0;
+                sink_fp = sink_persist ? state_load_file(optarg) : stdout;
+                if (!sink_fp) {
+                    perror(optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+            }
+        }
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = handle_sigint;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        signal(SIGPIPE, SIG_IGN);
+
+        for (fd = 0; fd < FD_SETSIZE; fd++)
+            conns[fd].gw = -1;
+
+        server_sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (server_sockfd < 0) {
+            perror("socket");
+            exit(1);
+        }
+        setsockopt(server_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        server_address.sin_family = AF_INET;
+        server_address.sin_addr.s_addr = htonl(INADDR_ANY);
+        server_address.sin_port = htons(port);
+        if (bind(server_sockfd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
+            perror("bind");
+            exit(1);
+        }
+        if (listen(server_sockfd, 16) < 0) {
+            perror("listen");
+            exit(1);
+        }
+        printf("aggregator listening on port %d, sink: %s\n", port, sink_fp ? "file" : "MariaDB");
+
+        FD_ZERO(&readfds);
+        FD_SET(server_sockfd, &readfds);
+
+        while (!stop_flag) {
+            testfds = readfds;
+            if (select(FD_SETSIZE, &testfds, NULL, NULL, NULL) < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("aggregator");
+                break;
+            }
+            for (fd = 0; fd < FD_SETSIZE; fd++) {
+                if (!FD_ISSET(fd, &testfds))
+                    continue;
+                if (fd == server_sockfd) {
+                    client_len = sizeof(client_address);
+                    client_sockfd = accept(server_sockfd, (struct sockaddr *)&client_address, &client_len);
+                    if (client_sockfd < 0) {
+                        perror("accept");
+                        continue;
+                    }
+                    if (client_sockfd >= FD_SETSIZE) {
+                        close(client_sockfd);
+                        continue;
+                    }
+                    FD_SET(client_sockfd, &readfds);
+                } else if (handle_readable(fd) < 0) {
+                    close_conn(fd, &readfds);
+                }
+            }
+        }
+
+        printf("\n[INFO] aggregator shutting down\n");
+        for (fd = 0; fd < FD_SETSIZE; fd++) {
+            if (fd != server_sockfd && FD_ISSET(fd, &readfds))
+                close_conn(fd, &readfds);
+        }
+        close(server_sockfd);
+        for (int i = 0; i < gateway_count; i++)
+            printf("  %s: %lu records, last seq %u\n", gateways[i].id, gateways[i].records, gateways[i].last_seq);
+        if (sink_fp && sink_fp != stdout)
+            fclose(sink_fp);
+        close_connect();
+        mysql_library_end();
+        return 0;
+    }
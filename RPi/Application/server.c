@@ -10,13 +10,103 @@
     #include <fcntl.h>
     #include <sys/stat.h>
     #include <mariadb/mysql.h>
+    #include <mariadb/errmsg.h>
     #include <pthread.h>
     #include <time.h>
     #include <signal.h>
     #include <stdatomic.h>
+    #include <errno.h>
+    #include <stdint.h>
+    #include <limits.h>
+    #include <netdb.h>
+    #include <zlib.h>
+    #include <math.h>
+    #if defined(__ARM_NEON)
+    #include <arm_neon.h>
+    #elif defined(__SSE__)
+    #include <xmmintrin.h>
+    #endif
+
+    #include "uplink.h"
 
     #define DEVICE_NORMAL_NAME "/dev/ads1115"
     #define DEVICE_ALERT_NAME "/dev/ads1115-alert"
+    #define IIO_SYSFS_DIR "/sys/bus/iio/devices"
+    #define IIO_DEVICE_NAME "ads1115"   // ads1115_overlay 註冊的 IIO device
+    #define IIO_BUFFER_LEN 1024
+    #define IIO_WATERMARK 64        // kfifo 累積這麼多筆才喚醒讀取，一次處理一整塊
+    #define SENSOR_ID "sensor_noise_001"
+    #define SERVER_PORT 5077
+
+    #define DB_QUEUE_LEN 256          // 資料庫離線時最多暫存幾筆
+    #define DB_RETRY_MAX_SEC 30       // 重連間隔上限 (指數退避)
+    #define SHUTDOWN_DRAIN_SEC 5      // 收到 SIGINT/SIGTERM 後最多花幾秒把資料寫完
+    #define DB_IO_TIMEOUT_SEC 2       // 單次讀寫逾時 (client library 讀取最多重試 3 次)
+    #define DB_JOIN_GRACE_MS 500      // drain 期限到了之後，再給寫入 thread 收尾的時間
+    #define ALERT_HOLD_SEC 5          // 警告送出後多久才清除 /dev/ads1115-alert
+    #define WINDOW_US (60LL * 1000000) // 平均值的時間窗
+
+    #define UPLINK_BATCH_MAX 64       // 每個 batch 最多幾筆
+    #define UPLINK_FLUSH_MS 1000      // 湊不滿一個 batch 時最多等多久
+    #define UPLINK_WINDOW 16          // 最多幾個 batch 在等 ACK
+    #define UPLINK_IO_TIMEOUT_SEC 5
+
+    /*
+     * 感測器紀錄檔 (-c 錄製 / -p 重播)
+     * 檔頭 struct trace_header，之後每筆 9 byte 的 struct trace_record，
+     * dt_us 為距離上一筆的微秒數，間隔超過 uint32 時以 TRACE_SKIP 補足。
+     * TRACE_IIO 是 IIO buffer 的原始樣本 (頻譜分析用)，取樣率記在檔頭的 iio_rate，0 表示沒有。
+     */
+    #define TRACE_MAGIC "MEMETRC1"
+    #define TRACE_SKIP 0
+    #define TRACE_SAMPLE 1
+    #define TRACE_ALERT 2
+    #define TRACE_IIO 3
+
+    struct trace_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t iio_rate;       // TRACE_IIO 樣本的取樣率 (Hz)
+        int64_t start_unix_us;   // 錄製開始的牆上時間，只供參考
+    };
+
+    struct trace_record {
+        uint32_t dt_us;
+        int32_t value;
+        uint8_t kind;
+    } __attribute__((packed));
+
+    /*
+     * Client 訂閱：連線後送一行
+     *   SUB sensors=<id>[,<id>...] min=<value> kinds=alert[,rollup][,live]
+     * 每個欄位都可省略 (預設：全部感測器、不限數值、只收 alert)，server 回 "OK" 或 "ERR <原因>"。
+     * 訂閱後每個事件一行 "<kind> <sensor> <value>"，只送符合條件的事件；
+     * 沒有送 SUB 的舊 client 照舊只收原始警告字串。
+     */
+    #define SUB_ALERT 0
+    #define SUB_ROLLUP 1
+    #define SUB_LIVE 2
+    #define SUB_KINDS 3
+    #define SUB_MAX_SENSORS 4
+    #define CLIENT_LINE_MAX 128
+
+    struct client {
+        int active;
+        int subscribed;        // 0: 舊版 client
+        unsigned kinds;        // 1 << SUB_xxx
+        long min;
+        int sensor_count;      // 0 表示全部感測器
+        char sensors[SUB_MAX_SENSORS][32];
+        char line[CLIENT_LINE_MAX];
+        size_t line_len;
+        int discard;           // 這一行太長，丟到換行為止
+    };
+
+    /* 頻譜分析：每 ANALYSIS_BLOCK 個樣本做一次 FFT，算各八度頻帶能量與 A 加權音量 */
+    #define ANALYSIS_BLOCK 256
+    #define ANALYSIS_BANDS 10
+    #define ANALYSIS_RATE_DEFAULT 860   // -b 沒指定 -r 時用 ADS1115 最高 860 SPS
+    #define ANALYSIS_FULL_SCALE 32768.0f
 
     static MYSQL *conn;
     static char mysql_ip[] = "Database_IP";
@@ -27,24 +117,94 @@
     static long sum_val = 0;
     static int sample_count = 0;
     pthread_mutex_t data_lock = PTHREAD_MUTEX_INITIALIZER;
-    pthread_mutex_t mysql_lock = PTHREAD_MUTEX_INITIALIZER;
     static int normal_fd = -1;
-    static int connect_status = 0;
+    static atomic_int connect_status = 0;
     static int alert_read_fd = -1, alert_write_fd = -1;
     static int server_sockfd = -1;
-    static pthread_t normal_thread;
+    static pthread_t normal_thread, db_thread;
+    static int normal_thread_started = 0, db_thread_started = 0;
     static volatile sig_atomic_t stop_flag = 0;
 
+    /* 資料庫寫入佇列：由 db_thread 獨佔 MySQL 連線，其他執行緒只把資料放進佇列 */
+    static struct db_record db_queue[DB_QUEUE_LEN];
+    static int db_head = 0, db_count = 0, db_dropped = 0;
+    static int db_draining = 0;               // 1: 停止重試，寫完或到期就結束
+    static int db_done = 0;                   // 1: 寫入 thread 已經結束
+    static int db_backpressure = 0;           // 1: 資料庫連著時佇列滿了就等，不丟資料 (重播用)
+    static struct timespec db_deadline;
+    pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t db_cond = PTHREAD_COND_INITIALIZER;
+
+    static FILE *trace_fp = NULL;             // -c: 錄製中的紀錄檔
+    static int64_t trace_last_us;
+    pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+    static const char *replay_path = NULL;    // -p: 重播的紀錄檔
+    static double replay_speed = 1.0;         // -s: 0 表示全速
+    static int replay_alert_fd = -1, replay_alert_wfd = -1;
+    static int64_t window_start_us = -1;
+
+    /* -u: 不直接連資料庫，改成把佇列打包上傳到 aggregator */
+    struct uplink_frame {
+        uint32_t seq;
+        uint32_t count;
+        uint32_t raw_len;
+        uint32_t len;
+        unsigned char *data;    // 壓縮後的 payload
+    };
+
+    static char *uplink_host = NULL;
+    static char uplink_port[8];
+    static char gateway_id[32];
+    static uint64_t uplink_session;
+    static struct uplink_frame uplink_window[UPLINK_WINDOW]; // 依序號排列，等 ACK 的 batch
+    static int uplink_pending = 0;
+    static uint32_t uplink_next_seq = 1;
+
+    /* client 表與各種事件的訂閱索引；取樣執行緒也會推播，所以用 client_lock 保護 */
+    static struct client clients[FD_SETSIZE];
+    static int sub_index[SUB_KINDS][FD_SETSIZE];
+    static int sub_count[SUB_KINDS];
+    static const char *sub_kind_names[SUB_KINDS] = { "alert", "rollup", "live" };
+    pthread_mutex_t client_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    /* 頻譜分析的輸入：ads1115 的 IIO buffer (/dev/iio:deviceN)，以實際的 sampling_frequency 取樣 */
+    static char iio_dir[64];
+    static int iio_fd = -1;
+    static pthread_t iio_thread;
+    static int iio_thread_started = 0;
+
+    static int analysis_rate = 0;          // 0: 沒有分析來源 (-r 只用來設定 IIO sampling_frequency)
+    static int analysis_gate = 0;          // 1: 只有 A 加權音量超過門檻才轉發警告
+    static float analysis_threshold = 0;   // dBFS(A)
+    static float analysis_level = -200.0f; // 最近一個 block 的 A 加權音量, 受 data_lock 保護
+    static float analysis_band_db[ANALYSIS_BANDS];
+
     void handle_sigint(int sig) {
         stop_flag = 1;
     }
 
+    static int64_t monotonic_us(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    /* 警告送出後暫停處理 ALERT_HOLD_SEC 秒再清除，期間照常服務 client */
+    static time_t alert_hold_until = 0;
+
     int open_connect(){        
+        unsigned int timeout = 3, io_timeout = DB_IO_TIMEOUT_SEC;
+
         conn = mysql_init(NULL);
         if (!conn) {
             fprintf(stderr, "MySQL init error\n");
             return -1;
         }
+        // 連線逾時不要用預設值，避免關機時卡在連線
+        mysql_options(conn, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+        // 查詢也要有逾時，否則卡住的 mysql_query 會讓關機時的 drain 等不完
+        mysql_options(conn, MYSQL_OPT_READ_TIMEOUT, &io_timeout);
+        mysql_options(conn, MYSQL_OPT_WRITE_TIMEOUT, &io_timeout);
         // Connect to MariaDB server on remote host 
         if (!mysql_real_connect(conn, mysql_ip, mysql_username, mysql_password, mysql_dbname, 0, NULL, 0)) {
             fprintf(stderr, "MySQL connection error: %s\n", mysql_error(conn));
@@ -56,183 +216,1489 @@
     }
 
     int close_connect(){
-        mysql_close(conn);
+        if (connect_status)
+            mysql_close(conn);
+        connect_status = 0;
         return 0;
     }
 
-    int insert_record(const char *device_id, const char *value, const char *status) {
+    /* 只在 db_thread 呼叫。回傳 -1 表示連線斷了，這筆要重送 */
+    static int db_insert(const struct db_record *rec) {
         char query[512];
-        pthread_mutex_lock(&mysql_lock);
 
         if (mysql_ping(conn)) {
             fprintf(stderr, "MySQL ping failed: %s\n", mysql_error(conn));
-            mysql_close(conn);
-            connect_status = 0;
-            if (open_connect() != 0) {
-                fprintf(stderr, "Reconnection failed\n");
-                pthread_mutex_unlock(&mysql_lock);
-                return -1;
-            }
+            close_connect();
+            return -1;
         }
 
         snprintf(query, sizeof(query),
             "INSERT INTO sensor_data (device_id, value, status) VALUES ('%s', '%s', '%s')",
-                device_id, value, status);
+                rec->device_id, rec->value, rec->status);
     
         if (mysql_query(conn, query)) {
+            unsigned int err = mysql_errno(conn);
+
             fprintf(stderr, "Insert error: %s\n", mysql_error(conn));
+            // ping 之後才斷線 (或逾時)：這筆沒寫進去，重連後重送
+            if (err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST) {
+                close_connect();
+                return -1;
+            }
         } else {
-            printf("Inserted: %s, %s, %s\n", device_id, value, status);
+            printf("Inserted: %s, %s, %s\n", rec->device_id, rec->value, rec->status);
         }
-        pthread_mutex_unlock(&mysql_lock);
+        return 0;
+    }
+
+    /*
+     * 放進寫入佇列，不會因為資料庫慢或離線而卡住呼叫端；佇列滿了就丟掉最舊的。
+     * 重播時 (db_backpressure) 只有在資料庫連著的時候才等佇列有空位，沒有資料庫也能播完。
+     */
+    int insert_record(const char *device_id, const char *value, const char *status) {
+        struct db_record *rec;
+
+        pthread_mutex_lock(&db_lock);
+        while (db_backpressure && connect_status && db_count == DB_QUEUE_LEN && !stop_flag) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            pthread_cond_timedwait(&db_cond, &db_lock, &ts);
+        }
+        if (db_count == DB_QUEUE_LEN) {
+            db_head = (db_head + 1) % DB_QUEUE_LEN;
+            db_count--;
+            db_dropped++;
+        }
+        rec = &db_queue[(db_head + db_count) % DB_QUEUE_LEN];
+        snprintf(rec->device_id, sizeof(rec->device_id), "%s", device_id);
+        snprintf(rec->value, sizeof(rec->value), "%s", value);
+        snprintf(rec->status, sizeof(rec->status), "%s", status);
+        db_count++;
+        pthread_cond_broadcast(&db_cond);
+        pthread_mutex_unlock(&db_lock);
 
         return 0;
     }
-    
+
+    /* 等到 deadline 或被喚醒，呼叫前要持有 db_lock */
+    static void db_wait_until(const struct timespec *deadline) {
+        if (db_draining && (deadline->tv_sec > db_deadline.tv_sec ||
+            (deadline->tv_sec == db_deadline.tv_sec && deadline->tv_nsec > db_deadline.tv_nsec)))
+            deadline = &db_deadline;
+        pthread_cond_timedwait(&db_cond, &db_lock, deadline);
+    }
+
+    static int db_past_deadline(void) {
+        struct timespec now;
+
+        if (!db_draining)
+            return 0;
+        clock_gettime(CLOCK_REALTIME, &now);
+        return now.tv_sec > db_deadline.tv_sec ||
+            (now.tv_sec == db_deadline.tv_sec && now.tv_nsec >= db_deadline.tv_nsec);
+    }
+
+    /* 背景連線資料庫並把佇列寫進去，啟動時資料庫沒開也不會擋住警告與 client 服務 */
+    void *db_thread_fn(void *arg) {
+        int retry_sec = 1;
+        struct timespec next_try = { 0, 0 };
+        struct db_record rec;
+
+        mysql_thread_init();
+        pthread_mutex_lock(&db_lock);
+        for (;;) {
+            struct timespec now;
+
+            if (db_draining && (db_count == 0 || db_past_deadline()))
+                break;
+
+            if (!connect_status) {
+                // 關機時不再重連：一次連線最多要 3 秒，會超過 drain 的期限
+                if (db_draining)
+                    break;
+                clock_gettime(CLOCK_REALTIME, &now);
+                if (now.tv_sec < next_try.tv_sec) {
+                    db_wait_until(&next_try);
+                    continue;
+                }
+                pthread_mutex_unlock(&db_lock);
+                int ret = open_connect();
+                pthread_mutex_lock(&db_lock);
+                if (ret != 0) {
+                    clock_gettime(CLOCK_REALTIME, &next_try);
+                    next_try.tv_sec += retry_sec;
+                    fprintf(stderr, "MariaDB unavailable, retry in %d s (%d queued)\n", retry_sec, db_count);
+                    retry_sec = (retry_sec * 2 > DB_RETRY_MAX_SEC) ? DB_RETRY_MAX_SEC : retry_sec * 2;
+                    continue;
+                }
+                printf("[INFO] Connected to MariaDB\n");
+                retry_sec = 1;
+            }
+
+            if (db_count == 0) {
+                clock_gettime(CLOCK_REALTIME, &now);
+                now.tv_sec += 1;
+                db_wait_until(&now);
+                continue;
+            }
+
+            rec = db_queue[db_head];
+            pthread_mutex_unlock(&db_lock);
+            int ret = db_insert(&rec);
+            pthread_mutex_lock(&db_lock);
+            if (ret == 0) {
+                db_head = (db_head + 1) % DB_QUEUE_LEN;
+                db_count--;
+                pthread_cond_broadcast(&db_cond);
+            }
+        }
+        if (db_count > 0 || db_dropped > 0)
+            fprintf(stderr, "[WARN] %d record(s) not written, %d dropped on overflow\n", db_count, db_dropped);
+        pthread_mutex_unlock(&db_lock);
+
+        close_connect();
+        mysql_thread_end();
+
+        pthread_mutex_lock(&db_lock);
+        db_done = 1;
+        pthread_cond_broadcast(&db_cond);
+        pthread_mutex_unlock(&db_lock);
+        return NULL;
+    }
+
+    /* 停止接收新資料後呼叫：把佇列寫完，最多等 sec 秒 */
+    void db_drain(int sec) {
+        pthread_mutex_lock(&db_lock);
+        clock_gettime(CLOCK_REALTIME, &db_deadline);
+        db_deadline.tv_sec += sec;
+        db_draining = 1;
+        pthread_cond_signal(&db_cond);
+        pthread_mutex_unlock(&db_lock);
+    }
+
+    /*
+     * db_drain 之後呼叫：等寫入 thread 結束，最多等到期限再加 DB_JOIN_GRACE_MS。
+     * 期限只在兩次操作之間檢查，進行中的查詢 (讀取逾時會重試) 可能還要好幾秒，
+     * 這時就不等了，回傳 -1；thread 還在用 client library，呼叫端不能 mysql_library_end。
+     */
+    int db_join(void) {
+        struct timespec deadline;
+        int done;
+
+        pthread_mutex_lock(&db_lock);
+        deadline = db_deadline;
+        deadline.tv_nsec += DB_JOIN_GRACE_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!db_done && pthread_cond_timedwait(&db_cond, &db_lock, &deadline) != ETIMEDOUT)
+            ;
+        done = db_done;
+        pthread_mutex_unlock(&db_lock);
+
+        if (!done) {
+            fprintf(stderr, "[WARN] database writer still busy after %d s, not waiting for it\n", SHUTDOWN_DRAIN_SEC);
+            pthread_detach(db_thread);
+            return -1;
+        }
+        pthread_join(db_thread, NULL);
+        return 0;
+    }
+
+    /* ---- 上傳到 aggregator ---- */
+    static int write_all(int fd, const void *buf, size_t len) {
+        const char *p = buf;
+        while (len > 0) {
+            ssize_t n = write(fd, p, len);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return -1;
+            p += n;
+            len -= n;
+        }
+        return 0;
+    }
+
+    static int read_all(int fd, void *buf, size_t len) {
+        char *p = buf;
+        while (len > 0) {
+            ssize_t n = read(fd, p, len);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return -1;
+            p += n;
+            len -= n;
+        }
+        return 0;
+    }
+
+    static int uplink_send(int sock, uint8_t type, uint32_t seq, uint32_t count, uint32_t raw_len,
+                           const void *payload, uint32_t len) {
+        struct uplink_header hdr;
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = htonl(UPLINK_MAGIC);
+        hdr.type = type;
+        hdr.seq = htonl(seq);
+        hdr.count = htonl(count);
+        hdr.raw_len = htonl(raw_len);
+        hdr.payload_len = htonl(len);
+        if (write_all(sock, &hdr, sizeof(hdr)) < 0)
+            return -1;
+        if (len > 0 && write_all(sock, payload, len) < 0)
+            return -1;
+        return 0;
+    }
+
+    static int uplink_recv(int sock, struct uplink_header *hdr) {
+        if (read_all(sock, hdr, sizeof(*hdr)) < 0)
+            return -1;
+        hdr->magic = ntohl(hdr->magic);
+        hdr->seq = ntohl(hdr->seq);
+        hdr->payload_len = ntohl(hdr->payload_len);
+        if (hdr->magic != UPLINK_MAGIC || hdr->payload_len != 0) {
+            fprintf(stderr, "uplink: bad frame from aggregator\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    /* aggregator 已寫入 seq 以前的 batch，從 window 移除 */
+    static void uplink_ack(uint32_t seq) {
+        int n = 0;
+
+        while (n < uplink_pending && uplink_window[n].seq <= seq) {
+            free(uplink_window[n].data);
+            n++;
+        }
+        if (n > 0) {
+            memmove(uplink_window, uplink_window + n, (uplink_pending - n) * sizeof(uplink_window[0]));
+            uplink_pending -= n;
+        }
+    }
+
+    /* 連線、打招呼，再把還沒 ACK 的 batch 依序重送 */
+    static int uplink_connect(void) {
+        struct addrinfo hints, *res, *ai;
+        struct uplink_hello hello;
+        struct uplink_header hdr;
+        struct timeval tv = { UPLINK_IO_TIMEOUT_SEC, 0 };
+        int sock = -1;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(uplink_host, uplink_port, &hints, &res) != 0)
+            return -1;
+        for (ai = res; ai; ai = ai->ai_next) {
+            sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (sock < 0)
+                continue;
+            if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            close(sock);
+            sock = -1;
+        }
+        freeaddrinfo(res);
+        if (sock < 0)
+            return -1;
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        memset(&hello, 0, sizeof(hello));
+        snprintf(hello.gateway_id, sizeof(hello.gateway_id), "%s", gateway_id);
+        hello.session = uplink_session;
+        if (uplink_send(sock, UPLINK_HELLO, 0, 0, 0, &hello, sizeof(hello)) < 0 ||
+            uplink_recv(sock, &hdr) < 0 || hdr.type != UPLINK_WELCOME) {
+            close(sock);
+            return -1;
+        }
+        uplink_ack(hdr.seq);
+
+        for (int i = 0; i < uplink_pending; i++) {
+            struct uplink_frame *f = &uplink_window[i];
+            if (uplink_send(sock, UPLINK_BATCH, f->seq, f->count, f->raw_len, f->data, f->len) < 0) {
+                close(sock);
+                return -1;
+            }
+        }
+        if (uplink_pending > 0)
+            printf("[INFO] uplink: resent %d batch(es) from seq %u\n", uplink_pending, uplink_window[0].seq);
+        return sock;
+    }
+
+    /* 從寫入佇列取出最多 UPLINK_BATCH_MAX 筆壓縮成一個 batch，呼叫前要持有 db_lock */
+    static struct uplink_frame *uplink_make_batch(void) {
+        struct db_record recs[UPLINK_BATCH_MAX];
+        struct uplink_frame *f = &uplink_window[uplink_pending];
+        uLongf len;
+        int n = 0;
+
+        // 先複製壓縮，成功了才從佇列拿掉，失敗時資料還留在佇列裡
+        while (n < UPLINK_BATCH_MAX && n < db_count) {
+            recs[n] = db_queue[(db_head + n) % DB_QUEUE_LEN];
+            n++;
+        }
+
+        f->raw_len = n * sizeof(recs[0]);
+        len = compressBound(f->raw_len);
+        f->data = malloc(len);
+        if (!f->data || compress2(f->data, &len, (const Bytef *)recs, f->raw_len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+            fprintf(stderr, "uplink: compress failed, %d record(s) kept in queue\n", n);
+            free(f->data);
+            f->data = NULL;
+            return NULL;
+        }
+        db_head = (db_head + n) % DB_QUEUE_LEN;
+        db_count -= n;
+        pthread_cond_broadcast(&db_cond);
+        f->len = len;
+        f->count = n;
+        f->seq = uplink_next_seq++;
+        uplink_pending++;
+        return f;
+    }
+
+    /* 取代 db_thread：把寫入佇列批次壓縮後經由同一條 TCP 連線送到 aggregator */
+    void *uplink_thread_fn(void *arg) {
+        int sock = -1, retry_sec = 1;
+        int64_t next_try = 0, last_batch = monotonic_us();
+
+        pthread_mutex_lock(&db_lock);
+        for (;;) {
+            int64_t now = monotonic_us();
+
+            if (db_draining && ((db_count == 0 && uplink_pending == 0) || db_past_deadline()))
+                break;
+
+            if (sock < 0) {
+                if (now < next_try) {
+                    struct timespec ts;
+                    clock_gettime(CLOCK_REALTIME, &ts);
+                    ts.tv_sec += 1;
+                    db_wait_until(&ts);
+                    continue;
+                }
+                pthread_mutex_unlock(&db_lock);
+                sock = uplink_connect();
+                pthread_mutex_lock(&db_lock);
+                if (sock < 0) {
+                    next_try = monotonic_us() + retry_sec * 1000000LL;
+                    fprintf(stderr, "uplink %s:%s unavailable, retry in %d s (%d queued, %d unacked)\n",
+                        uplink_host, uplink_port, retry_sec, db_count, uplink_pending);
+                    retry_sec = (retry_sec * 2 > DB_RETRY_MAX_SEC) ? DB_RETRY_MAX_SEC : retry_sec * 2;
+                    continue;
+                }
+                printf("[INFO] uplink connected to %s:%s as %s\n", uplink_host, uplink_port, gateway_id);
+                connect_status = 1;
+                retry_sec = 1;
+            }
+
+            int ret = 0;
+            if (uplink_pending < UPLINK_WINDOW && db_count > 0 &&
+                (db_count >= UPLINK_BATCH_MAX || db_draining || now - last_batch >= UPLINK_FLUSH_MS * 1000LL)) {
+                // 滿一個 batch、等太久或正在關機就送出
+                struct uplink_frame *f = uplink_make_batch();
+                last_batch = now;
+                if (f) {
+                    pthread_mutex_unlock(&db_lock);
+                    ret = uplink_send(sock, UPLINK_BATCH, f->seq, f->count, f->raw_len, f->data, f->len);
+                    pthread_mutex_lock(&db_lock);
+                } else {
+                    // 記憶體不足，資料還在佇列裡，稍後再試
+                    pthread_mutex_unlock(&db_lock);
+                    usleep(100000);
+                    pthread_mutex_lock(&db_lock);
+                }
+            } else {
+                // 等 ACK，最多 100ms 後再檢查佇列
+                fd_set fds;
+                struct timeval tv = { 0, 100000 };
+                struct uplink_header hdr;
+
+                pthread_mutex_unlock(&db_lock);
+                FD_ZERO(&fds);
+                FD_SET(sock, &fds);
+                if (select(sock + 1, &fds, NULL, NULL, &tv) > 0) {
+                    ret = uplink_recv(sock, &hdr);
+                    if (ret == 0 && hdr.type == UPLINK_ACK)
+                        uplink_ack(hdr.seq);
+                }
+                pthread_mutex_lock(&db_lock);
+            }
+            if (ret == 0)
+                continue;
+
+            fprintf(stderr, "uplink: connection lost, %d batch(es) will be resent\n", uplink_pending);
+            close(sock);
+            sock = -1;
+            connect_status = 0;
+        }
+        if (db_count > 0 || uplink_pending > 0 || db_dropped > 0)
+            fprintf(stderr, "[WARN] %d record(s) and %d unacked batch(es) not delivered, %d dropped on overflow\n",
+                db_count, uplink_pending, db_dropped);
+        pthread_mutex_unlock(&db_lock);
+
+        if (sock >= 0)
+            close(sock);
+        uplink_ack(UINT32_MAX);
+
+        pthread_mutex_lock(&db_lock);
+        db_done = 1;
+        pthread_cond_broadcast(&db_cond);
+        pthread_mutex_unlock(&db_lock);
+        return NULL;
+    }
+
+    /* ---- 頻譜分析 (FFT + 八度頻帶 + A 加權) ---- */
+    #if defined(__ARM_NEON)
+    #define ANALYSIS_SIMD 1
+    typedef float32x4_t v4f;
+    #define v4_load(p) vld1q_f32(p)
+    #define v4_store(p, v) vst1q_f32(p, v)
+    #define v4_add(a, b) vaddq_f32(a, b)
+    #define v4_sub(a, b) vsubq_f32(a, b)
+    #define v4_mul(a, b) vmulq_f32(a, b)
+    #define v4_dup(x) vdupq_n_f32(x)
+    #elif defined(__SSE__)
+    #define ANALYSIS_SIMD 1
+    typedef __m128 v4f;
+    #define v4_load(p) _mm_loadu_ps(p)
+    #define v4_store(p, v) _mm_storeu_ps(p, v)
+    #define v4_add(a, b) _mm_add_ps(a, b)
+    #define v4_sub(a, b) _mm_sub_ps(a, b)
+    #define v4_mul(a, b) _mm_mul_ps(a, b)
+    #define v4_dup(x) _mm_set1_ps(x)
+    #endif
+
+    static const float analysis_band_fc[ANALYSIS_BANDS] = {
+        31.5f, 63, 125, 250, 500, 1000, 2000, 4000, 8000, 16000
+    };
+    static float an_window[ANALYSIS_BLOCK];
+    static float an_weight[ANALYSIS_BLOCK / 2];  // 每個 bin 的 A 加權 (功率)
+    static float an_tw_re[ANALYSIS_BLOCK], an_tw_im[ANALYSIS_BLOCK]; // 第 h 級的旋轉因子從 h-1 開始
+    static unsigned short an_rev[ANALYSIS_BLOCK];
+    static int an_band_lo[ANALYSIS_BANDS], an_band_hi[ANALYSIS_BANDS];
+    static float an_norm;
+    static float an_re[ANALYSIS_BLOCK], an_im[ANALYSIS_BLOCK], an_pw[ANALYSIS_BLOCK / 2];
+    static float an_buf[ANALYSIS_BLOCK];
+    static int an_fill = 0;
+
+    static float a_weight_power(float f) {
+        double f2 = (double)f * f;
+        double ra = (12194.0 * 12194.0 * f2 * f2) /
+            ((f2 + 20.6 * 20.6) * sqrt((f2 + 107.7 * 107.7) * (f2 + 737.9 * 737.9)) * (f2 + 12194.0 * 12194.0));
+        return (float)(ra * ra * 1.58489); // +2.0 dB 讓 1kHz 為 0 dB
+    }
+
+    void analysis_init(int rate) {
+        const int n = ANALYSIS_BLOCK;
+        double s2 = 0;
+        int bits = 0;
+
+        while ((1 << bits) < n)
+            bits++;
+        for (int i = 0; i < n; i++) {
+            int r = 0;
+            for (int b = 0; b < bits; b++)
+                if (i & (1 << b))
+                    r |= 1 << (bits - 1 - b);
+            an_rev[i] = r;
+            an_window[i] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i / n); // Hann
+            s2 += (double)an_window[i] * an_window[i];
+        }
+        for (int h = 1; h < n; h <<= 1) {
+            for (int k = 0; k < h; k++) {
+                an_tw_re[h - 1 + k] = cosf((float)M_PI * k / h);
+                an_tw_im[h - 1 + k] = -sinf((float)M_PI * k / h);
+            }
+        }
+        an_weight[0] = 0; // 不算 DC
+        for (int k = 1; k < n / 2; k++)
+            an_weight[k] = a_weight_power((float)k * rate / n);
+        for (int b = 0; b < ANALYSIS_BANDS; b++) {
+            an_band_lo[b] = (int)ceilf(analysis_band_fc[b] / (float)M_SQRT2 * n / rate);
+            an_band_hi[b] = (int)ceilf(analysis_band_fc[b] * (float)M_SQRT2 * n / rate);
+            if (an_band_lo[b] < 1) an_band_lo[b] = 1;
+            if (an_band_hi[b] > n / 2) an_band_hi[b] = n / 2;
+        }
+        // 滿刻度正弦波 = 0 dBFS
+        an_norm = (float)(4.0 / (n * s2));
+        an_fill = 0;
+    }
+
+    static void analysis_fft(float *re, float *im) {
+        const int n = ANALYSIS_BLOCK;
+
+        for (int i = 0; i < n; i++) {
+            int j = an_rev[i];
+            if (j > i) {
+                float t = re[i]; re[i] = re[j]; re[j] = t;
+                t = im[i]; im[i] = im[j]; im[j] = t;
+            }
+        }
+        for (int h = 1; h < n; h <<= 1) {
+            const float *wr = an_tw_re + h - 1, *wi = an_tw_im + h - 1;
+            for (int g = 0; g < n; g += 2 * h) {
+                float *ar = re + g, *ai = im + g, *br = re + g + h, *bi = im + g + h;
+                int k = 0;
+    #ifdef ANALYSIS_SIMD
+                for (; h >= 4 && k < h; k += 4) {
+                    v4f xr = v4_load(br + k), xi = v4_load(bi + k);
+                    v4f cr = v4_load(wr + k), ci = v4_load(wi + k);
+                    v4f tr = v4_sub(v4_mul(xr, cr), v4_mul(xi, ci));
+                    v4f ti = v4_add(v4_mul(xr, ci), v4_mul(xi, cr));
+                    v4f yr = v4_load(ar + k), yi = v4_load(ai + k);
+                    v4_store(br + k, v4_sub(yr, tr));
+                    v4_store(bi + k, v4_sub(yi, ti));
+                    v4_store(ar + k, v4_add(yr, tr));
+                    v4_store(ai + k, v4_add(yi, ti));
+                }
+    #endif
+                for (; k < h; k++) {
+                    float tr = br[k] * wr[k] - bi[k] * wi[k];
+                    float ti = br[k] * wi[k] + bi[k] * wr[k];
+                    br[k] = ar[k] - tr;
+                    bi[k] = ai[k] - ti;
+                    ar[k] += tr;
+                    ai[k] += ti;
+                }
+            }
+        }
+    }
+
+    /* 對一個 block (已正規化到 +/-1) 做分析，回傳 A 加權音量 dBFS(A)，band_db 為各八度頻帶能量 */
+    float analysis_run(const float *x, float *band_db) {
+        const int n = ANALYSIS_BLOCK;
+        float mean = 0, weighted = 0;
+        int i = 0;
+
+        for (i = 0; i < n; i++)
+            mean += x[i];
+        mean /= n;
+
+        // ANALYSIS_BLOCK 為 4 的倍數，SIMD 版本不需要處理尾端
+    #ifdef ANALYSIS_SIMD
+        v4f vm = v4_dup(mean), vz = v4_dup(0);
+        for (i = 0; i < n; i += 4) {
+            v4_store(an_re + i, v4_mul(v4_sub(v4_load(x + i), vm), v4_load(an_window + i)));
+            v4_store(an_im + i, vz);
+        }
+    #else
+        for (i = 0; i < n; i++) {
+            an_re[i] = (x[i] - mean) * an_window[i];
+            an_im[i] = 0;
+        }
+    #endif
+
+        analysis_fft(an_re, an_im);
+
+    #ifdef ANALYSIS_SIMD
+        float acc[4];
+        v4f vacc = v4_dup(0);
+        for (i = 0; i < n / 2; i += 4) {
+            v4f r = v4_load(an_re + i), m = v4_load(an_im + i);
+            v4f p = v4_add(v4_mul(r, r), v4_mul(m, m));
+            v4_store(an_pw + i, p);
+            vacc = v4_add(vacc, v4_mul(p, v4_load(an_weight + i)));
+        }
+        v4_store(acc, vacc);
+        weighted = acc[0] + acc[1] + acc[2] + acc[3];
+    #else
+        for (i = 0; i < n / 2; i++) {
+            an_pw[i] = an_re[i] * an_re[i] + an_im[i] * an_im[i];
+            weighted += an_pw[i] * an_weight[i];
+        }
+    #endif
+
+        if (band_db) {
+            for (int b = 0; b < ANALYSIS_BANDS; b++) {
+                float e = 0;
+                for (int k = an_band_lo[b]; k < an_band_hi[b]; k++)
+                    e += an_pw[k];
+                band_db[b] = 10.0f * log10f(e * an_norm + 1e-20f);
+            }
+        }
+        return 10.0f * log10f(weighted * an_norm + 1e-20f);
+    }
+
+    /* 由取樣執行緒呼叫，湊滿一個 block 就分析一次 */
+    void analysis_push(long val) {
+        float bands[ANALYSIS_BANDS];
+        float level;
+
+        an_buf[an_fill++] = (float)val / ANALYSIS_FULL_SCALE;
+        if (an_fill < ANALYSIS_BLOCK)
+            return;
+        an_fill = 0;
+
+        level = analysis_run(an_buf, bands);
+        pthread_mutex_lock(&data_lock);
+        analysis_level = level;
+        memcpy(analysis_band_db, bands, sizeof(bands));
+        pthread_mutex_unlock(&data_lock);
+    }
+
+    /* 效能測試：量測每個 block 的分析時間，並換算在目前取樣率下佔用多少 CPU */
+    int analysis_bench(int rate) {
+        const int iterations = 20000;
+        static float block[ANALYSIS_BLOCK];
+        float bands[ANALYSIS_BANDS];
+        volatile float sink = 0;
+        struct timespec t0, t1;
+        unsigned int seed = 1;
+
+        analysis_init(rate);
+        for (int i = 0; i < ANALYSIS_BLOCK; i++) {
+            seed = seed * 1103515245u + 12345u;
+            // 兩個頻帶內的音 (rate/4 與 rate/32)，都在 Nyquist 以下，印出的頻帶才有意義
+            block[i] = 0.3f * sinf(2.0f * (float)M_PI * (rate / 4.0f) * i / rate) +
+                       0.2f * sinf(2.0f * (float)M_PI * (rate / 32.0f) * i / rate) +
+                       0.01f * ((float)(seed >> 16 & 0x7FFF) / 32768.0f - 0.5f);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i < iterations; i++)
+            sink += analysis_run(block, bands);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        double sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        double per_block_us = sec * 1e6 / iterations;
+        double samples_per_sec = (double)iterations * ANALYSIS_BLOCK / sec;
+        double load = rate / samples_per_sec * 100.0;
+
+        printf("analysis bench: %s, block=%d, rate=%d Hz, tones %.1f Hz + %.1f Hz\n",
+    #ifdef ANALYSIS_SIMD
+            "simd",
+    #else
+            "scalar",
+    #endif
+            ANALYSIS_BLOCK, rate, rate / 4.0, rate / 32.0);
+        printf("  %.2f us/block, %.0f samples/s, %.0fx realtime, %.4f%% of one core\n",
+            per_block_us, samples_per_sec, samples_per_sec / rate, load);
+        printf("  last level %.1f dBFS(A)\n", sink / iterations);
+        for (int b = 0; b < ANALYSIS_BANDS; b++)
+            if (an_band_hi[b] > an_band_lo[b])
+                printf("  band %7.1f Hz: %6.1f dBFS\n", analysis_band_fc[b], bands[b]);
+        return 0;
+    }
+
+    int trace_open(const char *path, int iio_rate) {
+        struct trace_header hdr;
+        struct timespec ts;
+
+        trace_fp = fopen(path, "wb");
+        if (!trace_fp) {
+            perror(path);
+            return -1;
+        }
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+        hdr.version = 1;
+        hdr.iio_rate = iio_rate;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        hdr.start_unix_us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        fwrite(&hdr, sizeof(hdr), 1, trace_fp);
+        trace_last_us = monotonic_us();
+        return 0;
+    }
+
+    /* 呼叫時必須持有 trace_lock */
+    static void trace_put(uint8_t kind, int64_t dt, long val) {
+        struct trace_record rec;
+
+        while (dt > UINT32_MAX) {
+            rec.dt_us = UINT32_MAX;
+            rec.value = 0;
+            rec.kind = TRACE_SKIP;
+            fwrite(&rec, sizeof(rec), 1, trace_fp);
+            dt -= UINT32_MAX;
+        }
+        rec.dt_us = (uint32_t)dt;
+        rec.value = (int32_t)val;
+        rec.kind = kind;
+        fwrite(&rec, sizeof(rec), 1, trace_fp);
+    }
+
+    void trace_write(uint8_t kind, long val) {
+        int64_t now;
+
+        if (!trace_fp)
+            return;
+        pthread_mutex_lock(&trace_lock);
+        now = monotonic_us();
+        trace_put(kind, now - trace_last_us, val);
+        trace_last_us = now;
+        pthread_mutex_unlock(&trace_lock);
+    }
+
+    /*
+     * 一次寫入一整塊等間隔取樣的樣本 (IIO buffer)，只拿一次鎖。
+     * 讀到時最後一筆記在現在，前面的依 period_us 往回推；跟上一筆重疊時就平均分配在兩者之間。
+     */
+    void trace_write_block(uint8_t kind, const int16_t *vals, int count, int64_t period_us) {
+        int64_t now, first, t;
+
+        if (!trace_fp || count <= 0)
+            return;
+        pthread_mutex_lock(&trace_lock);
+        now = monotonic_us();
+        first = now - (int64_t)(count - 1) * period_us;
+        if (first < trace_last_us)
+            first = trace_last_us;
+        trace_put(kind, first - trace_last_us, vals[0]);
+        t = first;
+        for (int i = 1; i < count; i++) {
+            int64_t next = first + (now - first) * i / (count - 1);
+
+            trace_put(kind, next - t, vals[i]);
+            t = next;
+        }
+        trace_last_us = t;
+        pthread_mutex_unlock(&trace_lock);
+    }
+
+    void trace_flush(void) {
+        if (!trace_fp)
+            return;
+        pthread_mutex_lock(&trace_lock);
+        fflush(trace_fp);
+        pthread_mutex_unlock(&trace_lock);
+    }
+
+    /* 依 client 表重建訂閱索引，必須持有 client_lock */
+    static void sub_index_rebuild(void) {
+        memset(sub_count, 0, sizeof(sub_count));
+        for (int fd = 0; fd < FD_SETSIZE; fd++) {
+            if (!clients[fd].active)
+                continue;
+            for (int k = 0; k < SUB_KINDS; k++) {
+                if (clients[fd].kinds & (1u << k))
+                    sub_index[k][sub_count[k]++] = fd;
+            }
+        }
+    }
+
+    void client_add(int fd) {
+        pthread_mutex_lock(&client_lock);
+        memset(&clients[fd], 0, sizeof(clients[fd]));
+        clients[fd].active = 1;
+        clients[fd].kinds = 1u << SUB_ALERT;   // 舊版 client 只收警告
+        sub_index_rebuild();
+        pthread_mutex_unlock(&client_lock);
+    }
+
+    /* 在 client_lock 內關閉，其他執行緒不會寫到已關閉 (或被重用) 的 fd */
+    void client_remove(int fd) {
+        pthread_mutex_lock(&client_lock);
+        clients[fd].active = 0;
+        clients[fd].kinds = 0;
+        close(fd);
+        sub_index_rebuild();
+        pthread_mutex_unlock(&client_lock);
+    }
+
+    static void client_reply(int fd, const char *msg) {
+        send(fd, msg, strlen(msg), MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+
+    /* 解析一行 SUB 指令並更新這個 client 的訂閱 */
+    static void client_command(int fd, char *line) {
+        struct client sub;
+        char *save, *tok, *item, *save2;
+
+        tok = strtok_r(line, " \t", &save);
+        if (!tok)
+            return;
+        if (strcmp(tok, "SUB") != 0) {
+            client_reply(fd, "ERR unknown command\n");
+            return;
+        }
+
+        memset(&sub, 0, sizeof(sub));
+        sub.min = LONG_MIN;
+        while ((tok = strtok_r(NULL, " \t", &save)) != NULL) {
+            if (strncmp(tok, "sensors=", 8) == 0) {
+                for (item = strtok_r(tok + 8, ",", &save2); item; item = strtok_r(NULL, ",", &save2)) {
+                    if (strcmp(item, "*") == 0) {
+                        sub.sensor_count = 0;
+                        break;
+                    }
+                    if (sub.sensor_count == SUB_MAX_SENSORS) {
+                        client_reply(fd, "ERR too many sensors\n");
+                        return;
+                    }
+                    snprintf(sub.sensors[sub.sensor_count++], sizeof(sub.sensors[0]), "%s", item);
+                }
+            } else if (strncmp(tok, "min=", 4) == 0) {
+                char *end;
+
+                errno = 0;
+                sub.min = strtol(tok + 4, &end, 10);
+                if (end == tok + 4 || *end != '\0' || errno == ERANGE) {
+                    client_reply(fd, "ERR bad min\n");
+                    return;
+                }
+            } else if (strncmp(tok, "kinds=", 6) == 0) {
+                for (item = strtok_r(tok + 6, ",", &save2); item; item = strtok_r(NULL, ",", &save2)) {
+                    int k;
+                    for (k = 0; k < SUB_KINDS; k++) {
+                        if (strcmp(item, sub_kind_names[k]) == 0 || (k == SUB_ALERT && strcmp(item, "alerts") == 0))
+                            break;
+                    }
+                    if (k == SUB_KINDS) {
+                        client_reply(fd, "ERR unknown kind\n");
+                        return;
+                    }
+                    sub.kinds |= 1u << k;
+                }
+            } else {
+                client_reply(fd, "ERR unknown field\n");
+                return;
+            }
+        }
+        if (!sub.kinds)
+            sub.kinds = 1u << SUB_ALERT;
+
+        pthread_mutex_lock(&client_lock);
+        clients[fd].subscribed = 1;
+        clients[fd].kinds = sub.kinds;
+        clients[fd].min = sub.min;
+        clients[fd].sensor_count = sub.sensor_count;
+        memcpy(clients[fd].sensors, sub.sensors, sizeof(sub.sensors));
+        sub_index_rebuild();
+        pthread_mutex_unlock(&client_lock);
+
+        printf("client fd %d subscribed: kinds 0x%x, min %ld, %d sensor(s)\n", fd, sub.kinds, sub.min, sub.sensor_count);
+        client_reply(fd, "OK\n");
+    }
+
+    /* client 送來的資料按行切開處理；一行太長就整行丟掉，剩下的部分不能當成新指令 */
+    void client_input(int fd, const char *buf, size_t len) {
+        struct client *c = &clients[fd];
+
+        for (size_t i = 0; i < len; i++) {
+            if (buf[i] == '\n' || buf[i] == '\r') {
+                c->line[c->line_len] = '\0';
+                if (c->line_len > 0 && !c->discard)
+                    client_command(fd, c->line);
+                c->line_len = 0;
+                c->discard = 0;
+            } else if (c->discard) {
+                continue;
+            } else if (c->line_len < sizeof(c->line) - 1) {
+                c->line[c->line_len++] = buf[i];
+            } else {
+                c->line_len = 0;
+                c->discard = 1;
+                client_reply(fd, "ERR line too long\n");
+            }
+        }
+    }
+
+    static int client_wants_sensor(const struct client *c, const char *sensor) {
+        if (c->sensor_count == 0)
+            return 1;
+        for (int i = 0; i < c->sensor_count; i++) {
+            if (strcmp(c->sensors[i], sensor) == 0)
+                return 1;
+        }
+        return 0;
+    }
+
+    /*
+     * 把事件送給有訂閱的 client。只走這種事件的索引，不掃全部 fd；
+     * 用 MSG_DONTWAIT，client 收太慢就丟掉這一筆，不會卡住取樣執行緒。
+     * legacy 不為 NULL 時，舊版 client 收到的是這個原始字串。
+     */
+    void publish(int kind, const char *sensor, long value, const char *legacy) {
+        char line[96];
+        int len = -1;
+
+        pthread_mutex_lock(&client_lock);
+        for (int i = 0; i < sub_count[kind]; i++) {
+            int fd = sub_index[kind][i];
+            const struct client *c = &clients[fd];
+
+            if (!c->subscribed) {
+                if (legacy)
+                    send(fd, legacy, strlen(legacy), MSG_DONTWAIT | MSG_NOSIGNAL);
+                continue;
+            }
+            if (value < c->min || !client_wants_sensor(c, sensor))
+                continue;
+            if (len < 0)
+                len = snprintf(line, sizeof(line), "%s %s %ld\n", sub_kind_names[kind], sensor, value);
+            send(fd, line, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+        pthread_mutex_unlock(&client_lock);
+    }
+
+    /* 結算目前這個時間窗的平均值並放進寫入佇列 */
+    void flush_window(void) {
+        pthread_mutex_lock(&data_lock);
+        long sum = sum_val;
+        int count = sample_count;
+        sum_val = 0;
+        sample_count = 0;
+        pthread_mutex_unlock(&data_lock);
+
+        if (count > 0) {
+            long avg = sum / count;
+            char avg_str[32];
+            snprintf(avg_str, sizeof(avg_str), "%ld", avg);
+            insert_record(SENSOR_ID, avg_str, "normal");
+            publish(SUB_ROLLUP, SENSOR_ID, avg, NULL);
+            if (!connect_status)
+                printf("MariaDB offline, queued average %s\n", avg_str);
+        } else {
+            printf("No data collected in last minute.\n");
+        }
+        trace_flush();
+    }
+
+    /* 時間窗以樣本的時間為準，重播時用紀錄檔的時間，所以結果和速度無關 */
+    void window_tick(int64_t now_us) {
+        if (window_start_us < 0)
+            window_start_us = now_us;
+        if (now_us - window_start_us >= WINDOW_US) {
+            window_start_us = now_us;
+            flush_window();
+        }
+    }
+
+    void ingest_sample(long val) {
+        pthread_mutex_lock(&data_lock);
+        sum_val += val;
+        sample_count++;
+        pthread_mutex_unlock(&data_lock);
+
+        publish(SUB_LIVE, SENSOR_ID, val, NULL);
+    }
+
+    static int sysfs_write(const char *attr, const char *val) {
+        char path[128];
+        int fd, ret;
+
+        snprintf(path, sizeof(path), "%s/%s", iio_dir, attr);
+        fd = open(path, O_WRONLY);
+        if (fd < 0)
+            return -1;
+        ret = write(fd, val, strlen(val)) < 0 ? -1 : 0;
+        close(fd);
+        return ret;
+    }
+
+    static int sysfs_read(const char *dir, const char *attr, char *buf, size_t len) {
+        char path[128];
+        int fd, n;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, attr);
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return -1;
+        n = read(fd, buf, len - 1);
+        close(fd);
+        if (n <= 0)
+            return -1;
+        buf[n] = '\0';
+        buf[strcspn(buf, "\n")] = '\0';
+        return 0;
+    }
+
+    /*
+     * 找到 ads1115 的 IIO device 並開啟 buffer，回傳實際的取樣率；找不到回傳 0。
+     * rate > 0 時先把 sampling_frequency 設成 rate (必須是 sampling_frequency_available 之一)。
+     */
+    int iio_open(int rate) {
+        char buf[32], dev[32];
+        int n;
+
+        for (n = 0; n < 16; n++) {
+            snprintf(iio_dir, sizeof(iio_dir), IIO_SYSFS_DIR "/iio:device%d", n);
+            if (sysfs_read(iio_dir, "name", buf, sizeof(buf)) == 0 && strcmp(buf, IIO_DEVICE_NAME) == 0)
+                break;
+        }
+        if (n == 16) {
+            iio_dir[0] = '\0';
+            return 0;
+        }
+
+        sysfs_write("buffer/enable", "0");
+        if (rate > 0) {
+            snprintf(buf, sizeof(buf), "%d", rate);
+            if (sysfs_write("sampling_frequency", buf) != 0 && sysfs_write("in_voltage_sampling_frequency", buf) != 0)
+                fprintf(stderr, "[WARN] %s does not support %d Hz\n", iio_dir, rate);
+        }
+        if (sysfs_read(iio_dir, "sampling_frequency", buf, sizeof(buf)) != 0 &&
+            sysfs_read(iio_dir, "in_voltage_sampling_frequency", buf, sizeof(buf)) != 0)
+            return 0;
+        rate = atoi(buf);
+        if (rate <= 0)
+            return 0;
+
+        // 只開 voltage0，不要 timestamp，每筆就是一個 s16
+        snprintf(buf, sizeof(buf), "%d", IIO_BUFFER_LEN);
+        if (sysfs_write("scan_elements/in_voltage0_en", "1") != 0 ||
+            sysfs_write("scan_elements/in_timestamp_en", "0") != 0 ||
+            sysfs_write("buffer/length", buf) != 0) {
+            fprintf(stderr, "[WARN] cannot enable IIO buffer of %s\n", iio_dir);
+            return 0;
+        }
+        // 預設 watermark 是 1，每筆都會喚醒一次；改成一次收一整塊
+        snprintf(buf, sizeof(buf), "%d", IIO_WATERMARK);
+        if (sysfs_write("buffer/watermark", buf) != 0)
+            fprintf(stderr, "[WARN] cannot set IIO buffer watermark of %s\n", iio_dir);
+        if (sysfs_write("buffer/enable", "1") != 0) {
+            fprintf(stderr, "[WARN] cannot enable IIO buffer of %s\n", iio_dir);
+            return 0;
+        }
+
+        snprintf(dev, sizeof(dev), "/dev/iio:device%d", n);
+        iio_fd = open(dev, O_RDONLY | O_NONBLOCK);
+        if (iio_fd < 0) {
+            perror(dev);
+            sysfs_write("buffer/enable", "0");
+            return 0;
+        }
+        printf("[INFO] spectral analysis fed by %s at %d Hz\n", dev, rate);
+        return rate;
+    }
+
+    void iio_close(void) {
+        if (iio_fd < 0)
+            return;
+        close(iio_fd);
+        iio_fd = -1;
+        sysfs_write("buffer/enable", "0");
+    }
+
+    /*
+     * 從 IIO buffer 讀原始樣本給頻譜分析，select 最多等一秒好檢查 stop_flag。
+     * kfifo 累積到 watermark 才喚醒，每次讀出一整塊，紀錄檔也整塊寫入。
+     */
+    void *iio_thread_fn(void *arg) {
+        int16_t samples[IIO_WATERMARK * 4];
+        int64_t period_us = 1000000 / analysis_rate;
+
+        while (!stop_flag) {
+            fd_set rfds;
+            struct timeval tv = { 1, 0 };
+
+            FD_ZERO(&rfds);
+            FD_SET(iio_fd, &rfds);
+            if (select(iio_fd + 1, &rfds, NULL, NULL, &tv) <= 0)
+                continue;
+
+            ssize_t len = read(iio_fd, samples, sizeof(samples));
+            int count = len > 0 ? len / (ssize_t)sizeof(samples[0]) : 0;
+
+            trace_write_block(TRACE_IIO, samples, count, period_us);
+            for (int i = 0; i < count; i++)
+                analysis_push(samples[i]);
+        }
+        return NULL;
+    }
+
     void *normal_thread_fn(void *arg) {
         int fd = *(int *)arg;
         free(arg);
         char buf[16];
     
-        time_t last_time = time(NULL);
         printf("thread is on! fd = %d\n", fd);
     
         while (atomic_load(&stop_flag) == 0) {
-            int nread;
-            
             memset(buf, 0, sizeof(buf));
             int len = read(fd, buf, sizeof(buf) - 1);
             if (len > 0) {
                 buf[len] = '\0';
-                char *newline = strtok(buf, "\r\n\t ");
                 long val = strtol(buf, NULL, 10);
     
-                pthread_mutex_lock(&data_lock);
-                sum_val += val;
-                sample_count++;
-                pthread_mutex_unlock(&data_lock);
+                trace_write(TRACE_SAMPLE, val);
+                ingest_sample(val);
             }
     
-            time_t now = time(NULL);
-            if (now - last_time >= 60) {
-                last_time = now;
-    
-                pthread_mutex_lock(&data_lock);
-                long sum = sum_val;
-                int count = sample_count;
-                sum_val = 0;
-                sample_count = 0;
-                pthread_mutex_unlock(&data_lock);
-    
-                if (count > 0) {
-                    long avg = sum / count;
-                    char avg_str[32];
-                    snprintf(avg_str, sizeof(avg_str), "%ld", avg);
-                    if (connect_status)
-                        insert_record("sensor_noise_001", avg_str, "normal");
-                    else
-                        printf("Connect error in sensor normal!\n");
-                } else {
-                    printf("No data collected in last minute.\n");
-                }
-            }
+            window_tick(monotonic_us());
     
             usleep(50000); // 小延遲避免過度佔用 CPU
         }
 
+        // 關機時把還沒滿一分鐘的資料也寫進去
+        flush_window();
+        return NULL;
+    }
+
+    /* A 加權門檻：沒開 -a 或最近一個 block 的音量夠大才放行 */
+    int alert_gate_pass(void) {
+        if (!analysis_gate)
+            return 1;
+        pthread_mutex_lock(&data_lock);
+        float level = analysis_level;
+        pthread_mutex_unlock(&data_lock);
+        if (level < analysis_threshold) {
+            printf("alert suppressed: %.1f dBFS(A) < %.1f\n", level, analysis_threshold);
+            return 0;
+        }
+        return 1;
+    }
+
+    /*
+     * 重播紀錄檔：樣本直接走 ingest_sample。警告在這裡依紀錄檔的時間順序判斷門檻並放進寫入佇列，
+     * 結果與重播速度無關；pipe 只用來叫主迴圈推播給 client。播完關掉 pipe，主迴圈看到 EOF 就結束。
+     */
+    void *replay_thread_fn(void *arg) {
+        FILE *fp = arg;
+        struct trace_record rec;
+        int64_t t_us = 0, start = monotonic_us();
+        long samples = 0, alerts = 0;
+
+        while (!stop_flag && fread(&rec, sizeof(rec), 1, fp) == 1) {
+            t_us += rec.dt_us;
+            if (replay_speed > 0) {
+                int64_t wait;
+                // 分段睡，讓 SIGINT 能在一秒內停下來
+                while (!stop_flag && (wait = start + (int64_t)(t_us / replay_speed) - monotonic_us()) > 0)
+                    usleep(wait > 1000000 ? 1000000 : wait);
+            }
+            window_tick(t_us);
+            if (rec.kind == TRACE_SAMPLE) {
+                ingest_sample(rec.value);
+                samples++;
+            } else if (rec.kind == TRACE_IIO) {
+                analysis_push(rec.value);
+            } else if (rec.kind == TRACE_ALERT && alert_gate_pass()) {
+                int32_t val = rec.value;
+                char str[16];
+
+                snprintf(str, sizeof(str), "%d", val);
+                insert_record(SENSOR_ID, str, "ALERT");
+                write(replay_alert_wfd, &val, sizeof(val));
+                alerts++;
+            }
+        }
+
+        double sec = (monotonic_us() - start) / 1e6;
+        printf("[INFO] Replay done: %ld samples, %ld alerts, %.1f s of trace in %.2f s (%.0fx)\n",
+            samples, alerts, t_us / 1e6, sec, sec > 0 ? t_us / 1e6 / sec : 0);
+        fclose(fp);
+        flush_window();
+        close(replay_alert_wfd);
         return NULL;
     }
 
+    /* 把警告推給訂閱的 client 並寫入資料庫；被 A 加權門檻擋下時回傳 0 */
+    int forward_alert(const char *string) {
+        if (!alert_gate_pass())
+            return 0;
+        publish(SUB_ALERT, SENSOR_ID, strtol(string, NULL, 10), string);
+        insert_record(SENSOR_ID, string, "ALERT");
+        return 1;
+    }
+
     void cleanup() {
+        int db_busy = 0;
+
         printf("\n[INFO] Cleaning up resources...\n");
     
-        if (normal_fd >= 0) close(normal_fd);
+        // 先停止接收：不再 accept，也不再處理警告
+        if (server_sockfd >= 0) close(server_sockfd);
         if (alert_read_fd >= 0) close(alert_read_fd);
         if (alert_write_fd >= 0) close(alert_write_fd);
-        if (server_sockfd >= 0) close(server_sockfd);
-    
-        pthread_cancel(normal_thread);
-        pthread_join(normal_thread, NULL);
-    
-        close_connect();
-        mysql_library_end();
+        if (replay_alert_fd >= 0) close(replay_alert_fd);
+
+        // 取樣執行緒看到 stop_flag 會自己結算最後的時間窗後結束
+        stop_flag = 1;
+        if (normal_thread_started)
+            pthread_join(normal_thread, NULL);
+        if (normal_fd >= 0) close(normal_fd);
+        if (iio_thread_started)
+            pthread_join(iio_thread, NULL);
+        iio_close();
+
+        if (db_thread_started) {
+            db_drain(SHUTDOWN_DRAIN_SEC);
+            if (db_join() != 0)
+                db_busy = 1;
+        }
+        if (!db_busy)
+            mysql_library_end();
+
+        if (trace_fp) {
+            fclose(trace_fp);
+            trace_fp = NULL;
+        }
     
         printf("[INFO] Server shutdown complete.\n");
-        mysql_thread_end();
     }
 
-    int main(void){
+    void usage(const char *prog) {
+        fprintf(stderr,
+            "Usage: %s [-P port] [-u host[:port] [-g id]] [-r rate] [-a dBA] [-b] [-c trace | -p trace [-s speed]]\n"
+            "  -P port  TCP port for clients (default %d)\n"
+            "  -u host  forward records to an aggregator instead of MariaDB (default port %d)\n"
+            "  -g id    gateway id sent to the aggregator (default: hostname)\n"
+            "  -r rate  set the IIO sampling_frequency used for spectral analysis\n"
+            "           (default: keep the driver setting; -b: %d)\n"
+            "  -a dBA   only forward alerts whose A-weighted level >= dBA (dBFS),\n"
+            "           needs the ads1115 IIO buffer or a trace captured with it\n"
+            "  -b       benchmark the analysis stage and exit\n"
+            "  -c trace capture raw samples, IIO samples and alerts to a trace file\n"
+            "  -p trace replay a trace instead of reading the sensor devices, exit when done\n"
+            "  -s speed replay speed multiplier, 0 = as fast as possible (default 1)\n",
+            prog, SERVER_PORT, UPLINK_PORT, ANALYSIS_RATE_DEFAULT);
+    }
+
+    int main(int argc, char *argv[]){
         int client_sockfd;
         int server_len, client_len;
         struct sockaddr_in server_address;
         struct sockaddr_in client_address;
         int result;
         fd_set readfds, testfds;
+        FILE *replay_fp = NULL;
+        const char *capture_path = NULL;
+        int server_port = SERVER_PORT;
+        char *colon;
         
         char string[10];
         int fd, max_fd = 0;
         int nread;
     
         int res, read_mode = O_RDONLY  | O_NONBLOCK, write_mode = O_WRONLY | O_NONBLOCK;
+        int opt, bench = 0, reuse = 1;
+        struct sigaction sa;
+        struct timeval tv, *timeout;
 
-        /* Signal Handling */
-        signal(SIGINT, handle_sigint);
+        while ((opt = getopt(argc, argv, "P:u:g:r:a:bc:p:s:h")) != -1) {
+            switch (opt) {
+            case 'P':
+                server_port = atoi(optarg);
+                break;
+            case 'u':
+                uplink_host = optarg;
+                colon = strrchr(optarg, ':');
+                if (colon) {
+                    *colon = '\0';
+                    snprintf(uplink_port, sizeof(uplink_port), "%s", colon + 1);
+                }
+                break;
+            case 'g':
+                snprintf(gateway_id, sizeof(gateway_id), "%s", optarg);
+                break;
+            case 'r':
+                analysis_rate = atoi(optarg);
+                if (analysis_rate <= 0) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'a':
+                analysis_gate = 1;
+                analysis_threshold = strtof(optarg, NULL);
+                break;
+            case 'b':
+                bench = 1;
+                break;
+            case 'c':
+                capture_path = optarg;
+                break;
+            case 'p':
+                replay_path = optarg;
+                break;
+            case 's':
+                replay_speed = strtod(optarg, NULL);
+                if (replay_speed < 0) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+            }
+        }
+
+        if (bench)
+            return analysis_bench(analysis_rate > 0 ? analysis_rate : ANALYSIS_RATE_DEFAULT);
+        if (capture_path && replay_path) {
+            usage(argv[0]);
+            exit(1);
+        }
+
+        /* 頻譜分析的取樣率以實際輸入為準：重播用紀錄檔記下的 iio_rate，實機用 IIO sampling_frequency */
+        if (replay_path) {
+            struct trace_header hdr;
+
+            replay_fp = fopen(replay_path, "rb");
+            if (!replay_fp) {
+                perror(replay_path);
+                exit(1);
+            }
+            if (fread(&hdr, sizeof(hdr), 1, replay_fp) != 1 || memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+                fprintf(stderr, "%s: not a sensor trace\n", replay_path);
+                exit(1);
+            }
+            if (analysis_rate > 0 && hdr.iio_rate && (int)hdr.iio_rate != analysis_rate)
+                fprintf(stderr, "[WARN] -r %d ignored, trace was sampled at %u Hz\n", analysis_rate, hdr.iio_rate);
+            analysis_rate = hdr.iio_rate;
+            printf("[INFO] Replaying %s (recorded at %lld us since epoch) at %s\n", replay_path,
+                (long long)hdr.start_unix_us, replay_speed > 0 ? "fixed speed" : "maximum speed");
+        } else if (analysis_gate || analysis_rate > 0 || capture_path) {
+            /*
+             * 只有要做頻譜分析 (-a/-r) 或擷取樣本 (-c) 時才接手 IIO buffer：
+             * 開啟時會中斷其他 iio_readdev，buffer 開著時 driver 也會停用自適應降速。
+             */
+            analysis_rate = iio_open(analysis_rate);
+        }
+        if (analysis_rate > 0) {
+            analysis_init(analysis_rate);
+        } else if (analysis_gate) {
+            fprintf(stderr, "-a needs the %s IIO buffer (or a trace captured with it) for spectral analysis\n", IIO_DEVICE_NAME);
+            exit(1);
+        }
+
+        if (capture_path && trace_open(capture_path, analysis_rate) != 0)
+            exit(1);
+
+        /* Signal Handling: 不用 SA_RESTART，讓 select 被 SIGINT/SIGTERM 打斷後能馬上結束 */
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = handle_sigint;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        signal(SIGPIPE, SIG_IGN); // client 斷線時 write 不要把整個 server 帶走
 
         /*  Create and name a socket for the server.  */
         server_sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (server_sockfd < 0) {
+            perror("socket");
+            exit(1);
+        }
+        setsockopt(server_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     
         server_address.sin_family = AF_INET;
         server_address.sin_addr.s_addr = htonl(INADDR_ANY);
-        server_address.sin_port = htons(5077);
+        server_address.sin_port = htons(server_port);
         server_len = sizeof(server_address);
     
-        bind(server_sockfd, (struct sockaddr *)&server_address, server_len);
-
-        if (open_connect() != 0) {
-            fprintf(stderr, "Failed to connect to MariaDB\n");
+        if (bind(server_sockfd, (struct sockaddr *)&server_address, server_len) < 0) {
+            perror("bind");
             exit(1);
         }
 
     /*  Create a connection queue and initialize readfds to handle input from server_sockfd.  */
-        listen(server_sockfd, 5);
+        if (listen(server_sockfd, 5) < 0) {
+            perror("listen");
+            exit(1);
+        }
     
         FD_ZERO(&readfds);
         FD_SET(server_sockfd, &readfds);
         if (server_sockfd > max_fd) max_fd = server_sockfd;
 
-        normal_fd = open(DEVICE_NORMAL_NAME, read_mode);
-        printf("normal fd = %d\n", normal_fd);
-
-        /* Create a thread for calculating value from /dev/normal */
-        int *arg = malloc(sizeof(int));
-        *arg = normal_fd;
-        if (pthread_create(&normal_thread, NULL, normal_thread_fn, arg) != 0) {
-            perror("Failed to create normal_fd thread");
+        /* 資料庫 (或 aggregator) 在背景連線，連不上也不影響警告與 client 服務 */
+        if (uplink_host) {
+            if (!uplink_port[0])
+                snprintf(uplink_port, sizeof(uplink_port), "%d", UPLINK_PORT);
+            if (!gateway_id[0])
+                gethostname(gateway_id, sizeof(gateway_id) - 1);
+            uplink_session = ((uint64_t)time(NULL) << 22) ^ ((uint64_t)getpid() << 1) ^ (uint64_t)monotonic_us();
+        }
+        if (pthread_create(&db_thread, NULL, uplink_host ? uplink_thread_fn : db_thread_fn, NULL) != 0) {
+            perror("Failed to create db thread");
             exit(1);
         }
+        db_thread_started = 1;
 
-        /* Open the /dev/alert and clear it.*/
-        alert_write_fd = open(DEVICE_ALERT_NAME, write_mode);
-        write(alert_write_fd, "clear\n", 6);
+        if (replay_fp) {
+            /* 重播模式：不開裝置，由 replay thread 取代取樣執行緒 */
+            int pipefd[2];
+            if (pipe(pipefd) < 0) {
+                perror("pipe");
+                exit(1);
+            }
+            db_backpressure = 1;
+            replay_alert_fd = pipefd[0];
+            replay_alert_wfd = pipefd[1];
+            FD_SET(replay_alert_fd, &readfds);
+            if (replay_alert_fd > max_fd) max_fd = replay_alert_fd;
+            if (pthread_create(&normal_thread, NULL, replay_thread_fn, replay_fp) != 0) {
+                perror("Failed to create replay thread");
+                exit(1);
+            }
+            normal_thread_started = 1;
+        } else {
+            normal_fd = open(DEVICE_NORMAL_NAME, read_mode);
+            if (normal_fd < 0) {
+                perror(DEVICE_NORMAL_NAME);
+            } else {
+                printf("normal fd = %d\n", normal_fd);
+
+                /* Create a thread for calculating value from /dev/normal */
+                int *arg = malloc(sizeof(int));
+                *arg = normal_fd;
+                if (pthread_create(&normal_thread, NULL, normal_thread_fn, arg) != 0) {
+                    perror("Failed to create normal_fd thread");
+                    free(arg);
+                } else {
+                    normal_thread_started = 1;
+                }
+            }
 
-        alert_read_fd = open(DEVICE_ALERT_NAME, read_mode);
-        FD_SET(alert_read_fd, &readfds);
-        if (alert_read_fd > max_fd) max_fd = alert_read_fd;
+            if (iio_fd >= 0) {
+                if (pthread_create(&iio_thread, NULL, iio_thread_fn, NULL) != 0)
+                    perror("Failed to create IIO thread");
+                else
+                    iio_thread_started = 1;
+            }
+
+            /* Open the /dev/alert and clear it.*/
+            alert_write_fd = open(DEVICE_ALERT_NAME, write_mode);
+            alert_read_fd = open(DEVICE_ALERT_NAME, read_mode);
+            if (alert_write_fd < 0 || alert_read_fd < 0) {
+                perror(DEVICE_ALERT_NAME);
+            } else {
+                write(alert_write_fd, "clear\n", 6);
+                FD_SET(alert_read_fd, &readfds);
+                if (alert_read_fd > max_fd) max_fd = alert_read_fd;
+            }
+        }
 
     
     /*  Now wait for clients and requests.
-        Since we have passed a null pointer as the timeout parameter, no timeout will occur.
-        The program will exit and report an error if select returns a value of less than 1.  */
+        No timeout is used unless an alert is on hold; SIGINT/SIGTERM interrupt select
+        and end the loop so cleanup() can drain pending writes.  */
     
         while(!stop_flag) {
+            timeout = NULL;
+            if (alert_hold_until) {
+                time_t now = time(NULL);
+                if (now >= alert_hold_until) {
+                    alert_hold_until = 0;
+                    write(alert_write_fd, "clear\n", 6);
+                    FD_SET(alert_read_fd, &readfds);
+                } else {
+                    tv.tv_sec = alert_hold_until - now;
+                    tv.tv_usec = 0;
+                    timeout = &tv;
+                }
+            }
             testfds = readfds;
 
-            result = select(FD_SETSIZE, &testfds, (fd_set *)0, (fd_set *)0, (struct timeval *) 0);
+            result = select(FD_SETSIZE, &testfds, (fd_set *)0, (fd_set *)0, timeout);
     
-            if(result < 1) {
+            if(result < 0) {
+                if (errno == EINTR)
+                    continue;
                 perror("server");
-                exit(1);
+                break;
             }
+            if (result == 0)
+                continue;
     
     /*  Once we know we've got activity,
         we find which descriptor it's on by checking each in turn using FD_ISSET.  */
@@ -241,7 +1707,17 @@
                     if(fd == server_sockfd) {
                         client_len = sizeof(client_address);
                         client_sockfd = accept(server_sockfd, (struct sockaddr *)&client_address, &client_len);
+                        if (client_sockfd < 0) {
+                            perror("accept");
+                            continue;
+                        }
+                        if (client_sockfd >= FD_SETSIZE) {
+                            // select 與 client 表都只到 FD_SETSIZE
+                            close(client_sockfd);
+                            continue;
+                        }
                         FD_SET(client_sockfd, &readfds);
+                        client_add(client_sockfd);
                         if (client_sockfd > max_fd) max_fd = client_sockfd;
                         printf("adding client on fd %d\n", client_sockfd);
                     }
@@ -261,20 +1737,34 @@
                             if (len > 1){
                                 string[sizeof(string) - 1] = '\0';
                             }
-                            for(int tmpfd = 0; tmpfd < FD_SETSIZE; tmpfd++){
-                                if(tmpfd == server_sockfd || tmpfd == fd || tmpfd == 0 || tmpfd == 1 || tmpfd == 2 || tmpfd == normal_fd || tmpfd == alert_read_fd)
-                                    continue;
-                                write(tmpfd, string, strlen(string));
+                            trace_write(TRACE_ALERT, strtol(string, NULL, 10));
+                            if (!forward_alert(string)) {
+                                write(alert_write_fd, "clear\n", 6);
+                                continue;
                             }
-                            insert_record("sensor_noise_001", string, "ALERT");
-                            sleep(5);
-                            write(alert_write_fd, "clear\n", 6);
+                            FD_CLR(alert_read_fd, &readfds);
+                            alert_hold_until = time(NULL) + ALERT_HOLD_SEC;
                         }
                     }
+                    else if(fd == replay_alert_fd){
+                        int32_t val;
+                        if (read(fd, &val, sizeof(val)) != sizeof(val)) {
+                            // 重播結束
+                            stop_flag = 1;
+                            break;
+                        }
+                        snprintf(string, sizeof(string), "%d", val);
+                        printf("replay alert message: %s\n", string);
+                        // 門檻與資料庫已經在 replay thread 處理過，這裡只推播
+                        publish(SUB_ALERT, SENSOR_ID, val, string);
+                    }
                     else {
-                        ioctl(fd, FIONREAD, &nread);
-                        if(nread == 0) {
-                            close(fd);
+                        char buf[CLIENT_LINE_MAX];
+                        ssize_t n = read(fd, buf, sizeof(buf));
+                        if (n > 0) {
+                            client_input(fd, buf, n);
+                        } else {
+                            client_remove(fd);
                             FD_CLR(fd, &readfds);
                             if (fd == max_fd) {
                                 max_fd = 0;
@@ -0,0 +1,49 @@
+    #ifndef MEME_UPLINK_H
+    #define MEME_UPLINK_H
+
+    #include <stdint.h>
+
+    /*
+     * Gateway (server.c -u) 與 aggregator 之間的上傳協定。
+     * 一條 TCP 連線上傳送 frame：固定長度 header (network byte order) + payload。
+     *
+     *   gateway -> aggregator  UPLINK_HELLO   payload = struct uplink_hello
+     *   aggregator -> gateway  UPLINK_WELCOME seq = 這個 gateway/session 已寫入的最後序號
+     *   gateway -> aggregator  UPLINK_BATCH   payload = zlib 壓縮的 struct db_record 陣列
+     *   aggregator -> gateway  UPLINK_ACK     seq = 已寫入資料庫的最後序號
+     *
+     * gateway 保留尚未 ACK 的 batch，重新連線後從 WELCOME 之後的序號開始重送；
+     * aggregator 對已寫入的序號只回 ACK 不重複寫入。
+     */
+    #define UPLINK_MAGIC 0x4D454D45u   // "MEME"
+    #define UPLINK_PORT 5078
+    #define UPLINK_MAX_PAYLOAD (1 << 20)
+
+    #define UPLINK_HELLO 1
+    #define UPLINK_WELCOME 2
+    #define UPLINK_BATCH 3
+    #define UPLINK_ACK 4
+
+    struct uplink_header {
+        uint32_t magic;
+        uint8_t type;
+        uint8_t reserved[3];
+        uint32_t seq;
+        uint32_t count;        // batch 內的筆數
+        uint32_t raw_len;      // 解壓縮後的長度
+        uint32_t payload_len;  // header 後面接著的 byte 數
+    } __attribute__((packed));
+
+    struct uplink_hello {
+        char gateway_id[32];
+        uint64_t session;      // gateway 每次啟動不同，序號從 1 重新開始
+    } __attribute__((packed));
+
+    /* 一筆要寫入 sensor_data 的資料，gateway 的寫入佇列與 batch 共用 */
+    struct db_record {
+        char device_id[32];
+        char value[32];
+        char status[16];
+    };
+
+    #endif
@@ -9,6 +9,7 @@ TARGET_DIR="/lib/modules/$(uname -r)/kernel/ads1115/"
 
 cd $ADS1115_DIR
 cp $WS2812_DIR/$WS2812_NAME.c ./
+cp $WS2812_DIR/$WS2812_NAME.h ./
 
 if [ ! -d "$TARGET_DIR" ]; then
     echo "目標目錄不存在：$DIR，自動建立該目錄"
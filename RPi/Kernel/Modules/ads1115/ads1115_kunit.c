@@ -0,0 +1,305 @@
+    /*
+     * ads1115_overlay 的 KUnit 測試，用 KUNIT=1 編譯時由 ads1115_overlay.c 最後 include 進來。
+     *
+     * 音量換算、校正範圍、文字格式與燈條填色是純函式直接測；I2C 端接假的 adapter，smbus_xfer 記下寫入的 config，
+     * 讀 conversion 時回傳指定的值 (照 ADS1115 的 big-endian 排列)，用來檢查 config bits 與 byte swap，
+     * 並量測 driver 這一側每秒能處理多少筆樣本。
+     */
+    #include <kunit/test.h>
+
+    #define ADS1115_KUNIT_SAMPLES 2000
+    #define ADS1115_KUNIT_LEDS 30
+
+    struct ads1115_fake_i2c {
+        u16 config;       // 最後一次寫入的 config
+        int config_writes;
+        u16 conv;         // 下一次讀 conversion 回傳的值
+        int conv_reads;
+        bool fail;        // 讀 conversion 回傳 -EIO
+    };
+
+    static struct ads1115_fake_i2c ads1115_fake;
+    static struct i2c_client *ads1115_kunit_saved; // 測試前的 ads1115_client，結束時還原
+    static struct i2c_client *ads1115_kunit_client;
+    static bool ads1115_kunit_adap_added;
+
+    static int ads1115_fake_smbus_xfer(struct i2c_adapter *adap, u16 addr, unsigned short flags,
+                                       char read_write, u8 command, int size, union i2c_smbus_data *data) {
+        if (addr != I2C_ADDR)
+            return -ENXIO;
+
+        if (read_write == I2C_SMBUS_WRITE && size == I2C_SMBUS_I2C_BLOCK_DATA &&
+            command == ADS1115_CONFIG && data->block[0] == 2) {
+            ads1115_fake.config = (data->block[1] << 8) | data->block[2];
+            ads1115_fake.config_writes++;
+            return 0;
+        }
+        if (read_write == I2C_SMBUS_READ && size == I2C_SMBUS_WORD_DATA && command == ADS1115_CONVERSION) {
+            if (ads1115_fake.fail)
+                return -EIO;
+            // 晶片先送 MSB，SMBus word 是 little-endian，所以 driver 看到的是 swap 過的值
+            data->word = swab16(ads1115_fake.conv);
+            ads1115_fake.conv_reads++;
+            return 0;
+        }
+        return -EOPNOTSUPP;
+    }
+
+    static u32 ads1115_fake_functionality(struct i2c_adapter *adap) {
+        return I2C_FUNC_SMBUS_WORD_DATA | I2C_FUNC_SMBUS_WRITE_I2C_BLOCK;
+    }
+
+    static const struct i2c_algorithm ads1115_fake_algo = {
+        .smbus_xfer = ads1115_fake_smbus_xfer,
+        .functionality = ads1115_fake_functionality,
+    };
+
+    static struct i2c_adapter ads1115_kunit_adap = {
+        .owner = THIS_MODULE,
+        .algo = &ads1115_fake_algo,
+        .name = "ads1115-kunit",
+    };
+
+    /* 需要假 I2C 的 case 呼叫，真的 ADS1115 已經在跑 (poll thread 會搶 ads1115_client) 就跳過 */
+    static void ads1115_kunit_need_fake(struct kunit *test) {
+        if (!ads1115_kunit_client)
+            kunit_skip(test, "a real ads1115 is bound");
+    }
+
+    static void ads1115_test_sound_to_level(struct kunit *test) {
+        static const struct {
+            s32 diff, range;
+            int last, level;
+        } cases[] = {
+            { 0, 800, 3, 3 },     // 0 級沿用上一次
+            { 99, 800, 3, 3 },    // 不到 1/8 還是 0 級
+            { 100, 800, 3, 1 },
+            { 450, 800, 0, 4 },
+            { 799, 800, 0, 7 },
+            { 800, 800, 0, 7 },   // 滿刻度夾在最高級
+            { 5000, 800, 0, 7 },
+            { 10, 0, 0, 7 },      // 還沒校正出範圍時直接最高級
+        };
+
+        for (int i = 0; i < ARRAY_SIZE(cases); i++)
+            KUNIT_EXPECT_EQ_MSG(test, sound_to_level(cases[i].diff, cases[i].range, cases[i].last),
+                                cases[i].level, "diff %d range %d", cases[i].diff, cases[i].range);
+    }
+
+    static void ads1115_test_level_to_lit(struct kunit *test) {
+        KUNIT_EXPECT_EQ(test, level_to_lit(0, 8), 1);
+        KUNIT_EXPECT_EQ(test, level_to_lit(3, 8), 4);
+        KUNIT_EXPECT_EQ(test, level_to_lit(LED_LEVELS - 1, 8), 8);
+        KUNIT_EXPECT_EQ(test, level_to_lit(3, 30), 15);
+        KUNIT_EXPECT_EQ(test, level_to_lit(LED_LEVELS - 1, 30), 30);
+        KUNIT_EXPECT_EQ(test, level_to_lit(0, 3), 1); // 短燈條也至少亮一顆
+    }
+
+    static void ads1115_test_led_fill_bar(struct kunit *test) {
+        static const unsigned char green[3] = { 0x00, 0xFF, 0x00 };
+        static const unsigned char red[3] = { 0xFF, 0x00, 0x00 };
+        static const unsigned char off[3] = { 0x00, 0x00, 0x00 };
+        unsigned char buf[9 * 3];
+
+        memset(buf, 0xAA, sizeof(buf));
+        led_fill_bar(buf, 8, 6, 4);
+        for (int i = 0; i < 4; i++)
+            KUNIT_EXPECT_MEMEQ(test, &buf[i * 3], green, 3);
+        for (int i = 4; i < 6; i++)
+            KUNIT_EXPECT_MEMEQ(test, &buf[i * 3], red, 3);
+        for (int i = 6; i < 8; i++)
+            KUNIT_EXPECT_MEMEQ(test, &buf[i * 3], off, 3);
+        KUNIT_EXPECT_EQ(test, buf[8 * 3], 0xAA); // 不能寫超過 count
+
+        // lit 比燈條長時只填滿整條
+        memset(buf, 0xAA, sizeof(buf));
+        led_fill_bar(buf, 8, 20, 4);
+        KUNIT_EXPECT_MEMEQ(test, &buf[7 * 3], red, 3);
+        KUNIT_EXPECT_EQ(test, buf[8 * 3], 0xAA);
+    }
+
+    static void ads1115_test_calib_range(struct kunit *test) {
+        static const struct {
+            s32 base, range;
+        } cases[] = {
+            { 16000, 2000 },      // 靠近中間：取到 0 的距離
+            { 16384, 2047 },      // 過了中間改取到滿刻度的距離
+            { 30000, 345 },
+            { 0, 0 },
+            { ADS1115_FULL_SCALE, 0 },
+            { 40000, 0 },         // 負電壓讀成 u16 的值，超出滿刻度
+            { -5, 0 },
+        };
+
+        for (int i = 0; i < ARRAY_SIZE(cases); i++)
+            KUNIT_EXPECT_EQ_MSG(test, ads1115_calib_range(cases[i].base), cases[i].range,
+                                "base %d", cases[i].base);
+        // 範圍 0 時音量一律是最高級，不會除以 0
+        KUNIT_EXPECT_EQ(test, sound_to_level(100, ads1115_calib_range(40000), 0), LED_LEVELS - 1);
+    }
+
+    static void ads1115_test_format_val(struct kunit *test) {
+        char buf[16];
+
+        KUNIT_EXPECT_EQ(test, ads1115_format_val(buf, sizeof(buf), 0), 2);
+        KUNIT_EXPECT_STREQ(test, buf, "0\n");
+        KUNIT_EXPECT_EQ(test, ads1115_format_val(buf, sizeof(buf), 12345), 6);
+        KUNIT_EXPECT_STREQ(test, buf, "12345\n");
+        KUNIT_EXPECT_EQ(test, ads1115_format_val(buf, sizeof(buf), -32768), 7);
+        KUNIT_EXPECT_STREQ(test, buf, "-32768\n");
+        // latest_val 存的是沒轉 s16 的原始值，負電壓會是 32768 以上
+        KUNIT_EXPECT_EQ(test, ads1115_format_val(buf, sizeof(buf), 0x8001), 6);
+        KUNIT_EXPECT_STREQ(test, buf, "32769\n");
+        KUNIT_EXPECT_EQ(test, ads1115_format_val(buf, sizeof(buf), INT_MIN), 12);
+        KUNIT_EXPECT_STREQ(test, buf, "-2147483648\n");
+        // buffer 不夠時回傳實際寫入的長度，read 才不會 copy 超過 kbuf
+        KUNIT_EXPECT_EQ(test, ads1115_format_val(buf, 4, -32768), 3);
+        KUNIT_EXPECT_STREQ(test, buf, "-32");
+    }
+
+    /* 單次轉換：OS=1 MUX=AIN0 PGA=2.048V MODE=single DR=128SPS */
+    static void ads1115_test_single_shot_config(struct kunit *test) {
+        int saved_dr = cur_dr;
+
+        ads1115_kunit_need_fake(test);
+        cur_dr = ADS1115_DR_DEFAULT;
+        ads1115_write_config(ads1115_config());
+        cur_dr = saved_dr;
+
+        KUNIT_EXPECT_EQ(test, ads1115_fake.config_writes, 1);
+        KUNIT_EXPECT_EQ(test, ads1115_fake.config, 0xC580);
+    }
+
+    /* 連續轉換：OS 與 MODE 都要是 0，DR=860SPS */
+    static void ads1115_test_continuous_config(struct kunit *test) {
+        ads1115_kunit_need_fake(test);
+        ads1115_write_config(CONFIG_CONT_BASE | (7 << CONFIG_DR_SHIFT));
+
+        KUNIT_EXPECT_EQ(test, ads1115_fake.config, 0x44E0);
+        KUNIT_EXPECT_EQ(test, ads1115_fake.config & (CONFIG_OS_SINGLE | CONFIG_MODE_SINGLE), 0);
+    }
+
+    static void ads1115_test_read_conversion(struct kunit *test) {
+        ads1115_kunit_need_fake(test);
+
+        ads1115_fake.conv = 0x1234;
+        KUNIT_EXPECT_EQ(test, ads1115_read_conversion(), 0x1234);
+        ads1115_fake.conv = 0x8001; // 負值，iio_sample 轉成 s16 後才是 -32767
+        KUNIT_EXPECT_EQ(test, ads1115_read_conversion(), 0x8001);
+        KUNIT_EXPECT_EQ(test, (s16)ads1115_read_conversion(), -32767);
+        ads1115_fake.fail = true;
+        KUNIT_EXPECT_EQ(test, ads1115_read_conversion(), -EIO);
+        KUNIT_EXPECT_EQ(test, ads1115_fake.conv_reads, 3);
+    }
+
+    static u64 ads1115_kunit_rate(int count, ktime_t start) {
+        u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+        return div64_u64((u64)count * NSEC_PER_SEC, max_t(u64, ns, 1));
+    }
+
+    /*
+     * 假 I2C 不花匯流排時間，量到的是 driver 與 I2C core 每筆的開銷。
+     * 連續轉換只讀結果，至少要跟得上最高的 860 SPS；單次轉換每筆多一次 config 寫入。
+     * 每筆也算一次音量級數與燈條填色，跟 led thread 做的事一樣。
+     */
+    static void ads1115_test_sample_rate(struct kunit *test) {
+        unsigned char *buf = kunit_kzalloc(test, ADS1115_KUNIT_LEDS * 3, GFP_KERNEL);
+        int max_sps = ads1115_data_rate[ARRAY_SIZE(ads1115_data_rate) - 1];
+        int level = 0;
+        u64 single, cont;
+        ktime_t start;
+        s32 val;
+
+        ads1115_kunit_need_fake(test);
+        KUNIT_ASSERT_NOT_NULL(test, buf);
+
+        start = ktime_get();
+        for (int i = 0; i < ADS1115_KUNIT_SAMPLES; i++) {
+            ads1115_write_config(CONFIG_BASE | (ADS1115_DR_DEFAULT << CONFIG_DR_SHIFT));
+            ads1115_fake.conv = i * 16;
+            val = ads1115_read_conversion();
+            level = sound_to_level(val, ADS1115_FULL_SCALE, level);
+            led_fill_bar(buf, ADS1115_KUNIT_LEDS, level_to_lit(level, ADS1115_KUNIT_LEDS), ADS1115_KUNIT_LEDS / 2);
+        }
+        single = ads1115_kunit_rate(ADS1115_KUNIT_SAMPLES, start);
+
+        ads1115_write_config(CONFIG_CONT_BASE | (7 << CONFIG_DR_SHIFT));
+        start = ktime_get();
+        for (int i = 0; i < ADS1115_KUNIT_SAMPLES; i++) {
+            ads1115_fake.conv = i * 16;
+            val = ads1115_read_conversion();
+            level = sound_to_level(val, ADS1115_FULL_SCALE, level);
+            led_fill_bar(buf, ADS1115_KUNIT_LEDS, level_to_lit(level, ADS1115_KUNIT_LEDS), ADS1115_KUNIT_LEDS / 2);
+        }
+        cont = ads1115_kunit_rate(ADS1115_KUNIT_SAMPLES, start);
+
+        KUNIT_EXPECT_EQ(test, ads1115_fake.conv_reads, 2 * ADS1115_KUNIT_SAMPLES);
+        kunit_info(test, "single-shot %llu samples/s, continuous %llu samples/s (max data rate %d SPS)\n",
+                   single, cont, max_sps);
+        KUNIT_EXPECT_GE(test, cont, (u64)max_sps);
+    }
+
+    static int ads1115_kunit_init(struct kunit *test) {
+        memset(&ads1115_fake, 0, sizeof(ads1115_fake));
+        return 0;
+    }
+
+    static int ads1115_kunit_suite_init(struct kunit_suite *suite) {
+        int ret;
+
+        ads1115_kunit_saved = ads1115_client;
+        if (ads1115_client)
+            return 0;
+
+        ret = i2c_add_adapter(&ads1115_kunit_adap);
+        if (ret)
+            return ret;
+        ads1115_kunit_adap_added = true;
+
+        // 不需要 i2c driver，只要一個位址是 0x48 的 client 給 i2c_smbus_* 使用
+        ads1115_kunit_client = i2c_new_dummy_device(&ads1115_kunit_adap, I2C_ADDR);
+        if (IS_ERR(ads1115_kunit_client)) {
+            ret = PTR_ERR(ads1115_kunit_client);
+            ads1115_kunit_client = NULL;
+            i2c_del_adapter(&ads1115_kunit_adap);
+            ads1115_kunit_adap_added = false;
+            return ret;
+        }
+        ads1115_client = ads1115_kunit_client;
+        return 0;
+    }
+
+    static void ads1115_kunit_suite_exit(struct kunit_suite *suite) {
+        if (ads1115_kunit_client) {
+            ads1115_client = ads1115_kunit_saved;
+            i2c_unregister_device(ads1115_kunit_client);
+            ads1115_kunit_client = NULL;
+        }
+        if (ads1115_kunit_adap_added) {
+            i2c_del_adapter(&ads1115_kunit_adap);
+            ads1115_kunit_adap_added = false;
+        }
+    }
+
+    static struct kunit_case ads1115_kunit_cases[] = {
+        KUNIT_CASE(ads1115_test_sound_to_level),
+        KUNIT_CASE(ads1115_test_level_to_lit),
+        KUNIT_CASE(ads1115_test_led_fill_bar),
+        KUNIT_CASE(ads1115_test_calib_range),
+        KUNIT_CASE(ads1115_test_format_val),
+        KUNIT_CASE(ads1115_test_single_shot_config),
+        KUNIT_CASE(ads1115_test_continuous_config),
+        KUNIT_CASE(ads1115_test_read_conversion),
+        KUNIT_CASE_SLOW(ads1115_test_sample_rate),
+        { }
+    };
+
+    static struct kunit_suite ads1115_kunit_suite = {
+        .name = "ads1115",
+        .init = ads1115_kunit_init,
+        .suite_init = ads1115_kunit_suite_init,
+        .suite_exit = ads1115_kunit_suite_exit,
+        .test_cases = ads1115_kunit_cases,
+    };
+    kunit_test_suite(ads1115_kunit_suite);
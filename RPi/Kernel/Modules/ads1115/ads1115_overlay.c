@@ -7,16 +7,28 @@
     #include <linux/byteorder/generic.h>
     #include <linux/miscdevice.h>
     #include <linux/poll.h>
+    #include <linux/ktime.h>
+    #include <linux/sched/types.h>
 
     #include <linux/of_gpio.h>
     #include <linux/platform_device.h>
 
+    #include <linux/iio/iio.h>
+    #include <linux/iio/buffer.h>
+    #include <linux/iio/trigger.h>
+    #include <linux/iio/trigger_consumer.h>
+    #include <linux/iio/triggered_buffer.h>
+
+    #include "meme-ws2812.h" // ads1115.sh 編譯前會從 ../ws2812 複製過來
+
     #define DRIVER_NAME "ads1115-ws2812"
     #define DEVICE_NAME "ads1115"
     #define DEVICE_ALERT_NAME "ads1115-alert"
     #define I2C_ADDR 0x48
-    #define LED_COUNT 8
+    #define LED_LEVELS 8 // 音量分成 8 級，燈條長度由 DTS 決定，顯示時再依比例放大
     #define ALERT_LEVEL 4
+    #define ADS1115_FULL_SCALE 32767
+    #define CALIB_SAMPLES 100 // 開機校正背景值用的樣本數
 
     static struct i2c_client *ads1115_client;
     static struct task_struct *poll_thread;
@@ -25,11 +37,44 @@
     static int latest_val = 0; // 給 user 讀取的最新值
     static int alert_val = 0; // 給 user 讀取的警告值
     static unsigned char *led_buf = NULL; //給 LED 的顏色
+    static int led_count = 0; // 燈條長度，從 ws2812 的 DTS led-count 取得
     static s32 sound_val = 0;
     static int sound_level = 0;
     static s32 base_line = 0;
-    static s32 max_line = 32767;
+    static s32 max_line = ADS1115_FULL_SCALE;
     static DECLARE_WAIT_QUEUE_HEAD(ads1115_alert_wq);
+    static struct iio_dev *ads1115_indio;
+    static struct iio_trigger *ads1115_trig;
+    static s16 iio_sample; // 最新一筆原始值與時間戳記，給 IIO buffer 用
+    static s64 iio_sample_ts;
+
+    // 排程與自適應取樣的參數，載入模組時設定
+    static int rt_prio = 0;
+    module_param(rt_prio, int, 0444);
+    MODULE_PARM_DESC(rt_prio, "SCHED_FIFO priority of the kthreads (1-99, 0 = SCHED_NORMAL)");
+    static int thread_cpu = -1;
+    module_param(thread_cpu, int, 0444);
+    MODULE_PARM_DESC(thread_cpu, "Bind the kthreads to this CPU (-1 = any)");
+    static bool adaptive = true;
+    module_param(adaptive, bool, 0644);
+    MODULE_PARM_DESC(adaptive, "Lower the data rate while the signal stays quiet");
+    static int quiet_band = 0;
+    module_param(quiet_band, int, 0644);
+    MODULE_PARM_DESC(quiet_band, "Quiet band around the baseline in raw counts (0 = one LED level)");
+    static int quiet_samples = 32;
+    module_param(quiet_samples, int, 0644);
+    MODULE_PARM_DESC(quiet_samples, "Consecutive quiet samples before stepping the data rate down");
+
+    // 統計資料，透過 sysfs 輸出
+    struct ads1115_jitter {
+        u64 sum_us;
+        u32 max_us;
+        u32 count;
+    };
+    static DEFINE_SPINLOCK(ads1115_stats_lock);
+    static struct ads1115_jitter poll_jitter; // 轉換等待比預期晚醒來多久
+    static struct ads1115_jitter led_jitter;  // LED 更新間隔比預期晚多久
+    static u32 rate_changes = 0;
 
     // 使用 A0 channel，MUX = A0-GND，FSR = +/-4.096V（PGA bits 001）
     #define ADS1115_CONFIG 0x01
@@ -39,15 +84,198 @@
     #define CONFIG_PGA_4_096V (1 << 9)
     #define CONFIG_PGA_2_048V (2 << 9) 
     #define CONFIG_MODE_SINGLE (1 << 8)
-    #define CONFIG_DR_128SPS (4 << 5)
-    #define CONFIG_DEFAULT (CONFIG_OS_SINGLE | CONFIG_MUX_AIN0 | CONFIG_PGA_2_048V | CONFIG_MODE_SINGLE | CONFIG_DR_128SPS)
+    #define CONFIG_DR_SHIFT 5
+    #define CONFIG_BASE (CONFIG_OS_SINGLE | CONFIG_MUX_AIN0 | CONFIG_PGA_2_048V | CONFIG_MODE_SINGLE)
+    #define CONFIG_CONT_BASE (CONFIG_MUX_AIN0 | CONFIG_PGA_2_048V) // MODE = 0：連續轉換
+    #define ADS1115_DR_DEFAULT 4 // 128 SPS
+    #define POLL_IDLE_MS 100      // 沒開 IIO buffer 時兩次轉換的間隔 (最高 data rate)
+    #define POLL_IDLE_MAX_MS 1000 // 安靜降速時間隔最長拉到 1 秒
+
+    // ADS1115 data rate (SPS)，index 就是 config 的 DR bits
+    static const int ads1115_data_rate[] = { 8, 16, 32, 64, 128, 250, 475, 860 };
+    static int ads1115_dr = ADS1115_DR_DEFAULT; // 最高 data rate (IIO sampling_frequency)
+    static int cur_dr = ADS1115_DR_DEFAULT;     // 目前實際使用的 data rate
+
+    static u16 ads1115_config(void) {
+        return CONFIG_BASE | (cur_dr << CONFIG_DR_SHIFT);
+    }
+
+    static void ads1115_write_config(u16 config) {
+        u8 config_buf[2] = { (config >> 8) & 0xFF, config & 0xFF };
+
+        i2c_smbus_write_i2c_block_data(ads1115_client, ADS1115_CONFIG, 2, config_buf);
+    }
+
+    /* 讀出轉換結果，SMBus word 是 little-endian，ADS1115 是 big-endian 要 swap；失敗回傳負的 errno */
+    static s32 ads1115_read_conversion(void) {
+        s32 val = i2c_smbus_read_word_data(ads1115_client, ADS1115_CONVERSION);
+
+        if (val < 0)
+            return val;
+        return (val >> 8) | ((val & 0xFF) << 8);
+    }
+
+    /* 單次轉換所需時間，多留 100us 餘裕 */
+    static unsigned long ads1115_conv_us(void) {
+        return 1000000 / ads1115_data_rate[cur_dr] + 100;
+    }
+
+    /* 沒開 IIO buffer 時的轉換間隔，data rate 降幾倍就拉長幾倍 */
+    static unsigned int ads1115_idle_ms(void) {
+        unsigned int ms = POLL_IDLE_MS * ads1115_data_rate[ads1115_dr] / ads1115_data_rate[cur_dr];
+
+        return min(ms, (unsigned int)POLL_IDLE_MAX_MS);
+    }
+
+    /*
+     * 自適應取樣：連續 quiet_samples 筆都在基準值 ± quiet_band 內就降一級 data rate，
+     * 一旦超出範圍馬上回到最高。IIO buffer 開著時固定用 sampling_frequency，
+     * 否則用 iio_readdev 這類固定取樣率的工具會讀到錯的資料。
+     * diff < 0 表示只檢查 buffer 狀態，不算一筆樣本。呼叫時必須持有 ads1115_lock。
+     */
+    static void ads1115_adapt_rate(s32 diff) {
+        static int quiet_count = 0;
+        int band = quiet_band > 0 ? quiet_band : max_line / LED_LEVELS;
+        int new_dr = cur_dr;
+
+        if (iio_buffer_enabled(ads1115_indio)) {
+            quiet_count = 0;
+            new_dr = ads1115_dr;
+        } else if (diff < 0) {
+            return;
+        } else if (!adaptive || diff > band) {
+            quiet_count = 0;
+            new_dr = ads1115_dr;
+        } else if (quiet_samples > 0 && ++quiet_count >= quiet_samples && cur_dr > 0) {
+            quiet_count = 0;
+            new_dr = cur_dr - 1;
+        }
+
+        if (new_dr != cur_dr) {
+            cur_dr = new_dr;
+            spin_lock(&ads1115_stats_lock);
+            rate_changes++;
+            spin_unlock(&ads1115_stats_lock);
+        }
+    }
+
+    static void ads1115_jitter_add(struct ads1115_jitter *j, s64 late_us) {
+        if (late_us < 0)
+            late_us = 0;
+        spin_lock(&ads1115_stats_lock);
+        j->sum_us += late_us;
+        j->max_us = max_t(u32, j->max_us, late_us);
+        j->count++;
+        spin_unlock(&ads1115_stats_lock);
+    }
+
+    /* 建立 kthread，依模組參數綁 CPU 與設定 SCHED_FIFO 後才開始跑 */
+    static struct task_struct *ads1115_thread_run(int (*fn)(void *), const char *name) {
+        struct task_struct *task;
+
+        task = kthread_create(fn, NULL, "%s", name);
+        if (IS_ERR(task))
+            return task;
+
+        if (thread_cpu >= 0) {
+            if (thread_cpu < nr_cpu_ids && cpu_online(thread_cpu))
+                kthread_bind(task, thread_cpu);
+            else
+                pr_warn(DRIVER_NAME ": cpu %d not online, %s not bound\n", thread_cpu, name);
+        }
+
+        if (rt_prio > 0) {
+            struct sched_attr attr = {
+                .sched_policy = SCHED_FIFO,
+                .sched_priority = clamp(rt_prio, 1, MAX_RT_PRIO - 1),
+            };
+
+            if (sched_setattr_nocheck(task, &attr))
+                pr_warn(DRIVER_NAME ": failed to set SCHED_FIFO for %s\n", name);
+        }
 
-    extern void ws2812_send_from_kernel(const u8 *rgb, size_t count);
+        wake_up_process(task);
+        return task;
+    }
+
+    /*
+     * 停止 kthread 並清成 NULL，重複呼叫沒關係。
+     * probe 用 devm action 註冊：devm 依註冊的反向順序釋放，thread 會比 IIO 裝置與 led_buf 先停，
+     * probe 中途失敗也不會留下還在用已釋放記憶體的 thread。
+     */
+    static void ads1115_thread_stop(void *data) {
+        struct task_struct **task = data;
+
+        if (*task) {
+            kthread_stop(*task);
+            *task = NULL;
+        }
+    }
+
+    /* 開機測試燈號：前半段或後半段依序亮 紅 綠 藍 白 */
+    static void led_fill_pattern(int second_half) {
+        static const unsigned char colors[4][3] = {
+            { 0xFF, 0x00, 0x00 },  // Red
+            { 0x00, 0xFF, 0x00 },  // Green
+            { 0x00, 0x00, 0xFF },  // Blue
+            { 0xFF, 0xFF, 0xFF },  // White
+        };
+        int half = led_count / 2;
+
+        memset(led_buf, 0, led_count * 3);
+        for (int i = 0; i < led_count; i++) {
+            if ((i < half) == !second_half)
+                memcpy(&led_buf[i * 3], colors[(i - (second_half ? half : 0)) % 4], 3);
+        }
+    }
+
+    /*
+     * 校正：背景平均值到 0 與到滿刻度兩邊取較近的距離，再縮成 1/8 當音量範圍。
+     * 平均值不在 0 ~ 滿刻度內 (負電壓讀成 u16 的值) 時範圍是 0，sound_to_level 會直接給最高級。
+     */
+    static s32 ads1115_calib_range(s32 base) {
+        s32 range = min(base, ADS1115_FULL_SCALE - base);
+
+        return range > 0 ? range >> 3 : 0;
+    }
+
+    /* /dev/ads1115 與 /dev/ads1115-alert 的文字格式，回傳實際寫入的長度 (不含結尾的 0) */
+    static int ads1115_format_val(char *buf, size_t size, int val) {
+        return scnprintf(buf, size, "%d\n", val);
+    }
+
+    /* 與基準值的差距換算成 0 ~ LED_LEVELS-1 級，0 級沿用上一次的級數避免燈閃爍 */
+    static int sound_to_level(s32 diff, s32 range, int last_level) {
+        int level = range > 0 ? diff * LED_LEVELS / range : LED_LEVELS - 1;
+
+        if (level > LED_LEVELS - 1)
+            level = LED_LEVELS - 1;
+        return level == 0 ? last_level : level;
+    }
+
+    /* 級數換算成要亮幾顆燈，依燈條長度等比例放大，至少亮一顆 */
+    static int level_to_lit(int level, int count) {
+        int lit = (level + 1) * count / LED_LEVELS;
+
+        return lit < 1 ? 1 : lit;
+    }
+
+    /* 前 lit 顆亮燈，alert_leds 之前是綠色、之後是紅色，其餘熄滅 */
+    static void led_fill_bar(unsigned char *buf, int count, int lit, int alert_leds) {
+        static const unsigned char green[3] = { 0x00, 0xFF, 0x00 };
+        static const unsigned char red[3] = { 0xFF, 0x00, 0x00 };
+
+        memset(buf, 0, count * 3);
+        for (int i = 0; i < lit && i < count; i++)
+            memcpy(&buf[i * 3], i < alert_leds ? green : red, 3);
+    }
 
     static int ads1115_poll_fn(void *data) {
         int i;
-        u8 config_buf[2];
         s32 tmp_val;
+        s32 sum = 0;
+        int cont_dr = -1; // 連續轉換模式使用中的 data rate，-1 表示目前是單次轉換
+        ktime_t next = 0; // 連續轉換模式下一次讀取的時間
         
         if (!led_buf) {
             pr_err(DRIVER_NAME ": led_buf not initialized!\n");
@@ -55,53 +283,93 @@
         }
         
         mutex_lock(&ads1115_lock);
-        //初始化背景數值，以100次為限
-        for(i = 0; i < 100; i++){
-            // 每次都觸發一次單次轉換
-            config_buf[0] = (CONFIG_DEFAULT >> 8) & 0xFF;
-            config_buf[1] = CONFIG_DEFAULT & 0xFF;
-            i2c_smbus_write_i2c_block_data(ads1115_client, ADS1115_CONFIG, 2, config_buf);
+        //初始化背景數值，以CALIB_SAMPLES次為限
+        for(i = 0; i < CALIB_SAMPLES; i++){
+            // 每次都觸發一次單次轉換，校正固定用預設 data rate
+            ads1115_write_config(CONFIG_BASE | (ADS1115_DR_DEFAULT << CONFIG_DR_SHIFT));
             msleep(15);
             
-            tmp_val = i2c_smbus_read_word_data(ads1115_client, ADS1115_CONVERSION);
-            tmp_val = (tmp_val >> 8) | ((tmp_val & 0xFF) << 8);
+            tmp_val = ads1115_read_conversion();
             if (tmp_val <= 0) {
                 pr_err(DRIVER_NAME ": read error\n");
                 i--;
             } else {
-                base_line += tmp_val;
+                sum += tmp_val;
             }
             msleep(15);
         }
         //取得基準值
-        base_line = base_line / 100;
-        //取得最小範圍值
-        max_line = (max_line - base_line > base_line) ? base_line : max_line - base_line;
-        max_line = (max_line >> 3); // max_line * 0.125 縮小閾值
+        base_line = sum / CALIB_SAMPLES;
+        //取得最小範圍值，縮小成 1/8 當閾值
+        max_line = ads1115_calib_range(base_line);
         mutex_unlock(&ads1115_lock);
 
         while (!kthread_should_stop()) {
-            // 每次都觸發一次單次轉換
-            config_buf[0] = (CONFIG_DEFAULT >> 8) & 0xFF;
-            config_buf[1] = CONFIG_DEFAULT & 0xFF;
-            i2c_smbus_write_i2c_block_data(ads1115_client, ADS1115_CONFIG, 2, config_buf);
+            bool buffered = iio_buffer_enabled(ads1115_indio);
+            unsigned long conv_us;
+            unsigned int idle_ms;
+            ktime_t start;
+            u16 config;
+            int dr;
 
-            msleep(15); // 等待 conversion 完成
+            mutex_lock(&ads1115_lock);
+            ads1115_adapt_rate(-1); // buffer 剛開啟時先回到 sampling_frequency 再取樣
+            dr = cur_dr;
+            config = ads1115_config();
+            conv_us = ads1115_conv_us();
+            mutex_unlock(&ads1115_lock);
+
+            if (buffered) {
+                /*
+                 * IIO buffer 開著：ADS1115 設成連續轉換，之後只讀轉換結果，
+                 * 依 data rate 的週期排程 (絕對時間，不累積誤差)，實際取樣率才會等於 sampling_frequency。
+                 */
+                s64 period_us = 1000000 / ads1115_data_rate[dr];
+                s64 wait_us;
+
+                if (cont_dr != dr) {
+                    ads1115_write_config(CONFIG_CONT_BASE | (dr << CONFIG_DR_SHIFT));
+                    cont_dr = dr;
+                    next = ktime_add_us(ktime_get(), 100); // 第一筆轉換要多一點時間開始
+                }
+                next = ktime_add_us(next, period_us);
+                wait_us = ktime_us_delta(next, ktime_get());
+                if (wait_us > 0) {
+                    usleep_range(wait_us, wait_us + 20);
+                    ads1115_jitter_add(&poll_jitter, ktime_us_delta(ktime_get(), next));
+                } else if (-wait_us > period_us) {
+                    // 落後超過一個週期就重新對齊，不要連續補讀同一筆
+                    next = ktime_get();
+                }
+            } else {
+                // 沒開 buffer：每次觸發一次單次轉換，轉完 ADC 自己進入省電
+                cont_dr = -1;
+                ads1115_write_config(config);
+                start = ktime_get();
+                usleep_range(conv_us, conv_us + 500); // 等待 conversion 完成
+                ads1115_jitter_add(&poll_jitter, ktime_us_delta(ktime_get(), start) - conv_us);
+            }
 
             mutex_lock(&ads1115_lock);
-            sound_val = i2c_smbus_read_word_data(ads1115_client, ADS1115_CONVERSION);
-            // swap bytes (ADS1115是big-endian)
-            sound_val = (sound_val >> 8) | ((sound_val & 0xFF) << 8);
+            tmp_val = ads1115_read_conversion();
+            if (tmp_val >= 0) {
+                sound_val = tmp_val;
+                latest_val = tmp_val;
+                iio_sample = (s16)tmp_val;
+                iio_sample_ts = iio_get_time_ns(ads1115_indio);
+                ads1115_adapt_rate(abs(tmp_val - base_line));
+            }
+            idle_ms = ads1115_idle_ms();
             mutex_unlock(&ads1115_lock);
 
-            if (sound_val < 0) {
+            if (tmp_val < 0) {
                 pr_err(DRIVER_NAME ": read error\n");
-            } else {
-                mutex_lock(&ads1115_lock);
-                latest_val = sound_val; 
-                mutex_unlock(&ads1115_lock);
+            } else if (buffered) {
+                // 有人在用 IIO buffer 抓資料：推一筆進 kfifo，不休息直接等下一個週期
+                iio_trigger_poll_nested(ads1115_trig);
+                continue;
             }
-            msleep(100);
+            msleep(idle_ms);
         }
         return 0;
     }
@@ -111,53 +379,31 @@
         s32 last_val = 0;
         int continue_flag = 0;
         int last_led_count = 1;
-        unsigned char rgb1[] = {
-            0xFF, 0x00, 0x00,  // LED 1: Red
-            0x00, 0xFF, 0x00,  // LED 2: Green
-            0x00, 0x00, 0xFF,  // LED 3: Blue
-            0xFF, 0xFF, 0xFF,  // LED 4: White
-            0x00, 0x00, 0x00,  // LED 5: None
-            0x00, 0x00, 0x00,  // LED 6: None
-            0x00, 0x00, 0x00,  // LED 7: None
-            0x00, 0x00, 0x00   // LED 8: None
-        };
-
-        unsigned char rgb2[] = {
-            0x00, 0x00, 0x00,  // LED 1: None
-            0x00, 0x00, 0x00,  // LED 2: None
-            0x00, 0x00, 0x00,  // LED 3: None
-            0x00, 0x00, 0x00,   // LED 4: None
-            0xFF, 0x00, 0x00,  // LED 5: Red
-            0x00, 0xFF, 0x00,  // LED 6: Green
-            0x00, 0x00, 0xFF,  // LED 7: Blue
-            0xFF, 0xFF, 0xFF   // LED 8: White
-        };
-
-        unsigned char reset[] = {
-            0x00, 0x00, 0x00,  // LED 1: None
-            0x00, 0x00, 0x00,  // LED 2: None
-            0x00, 0x00, 0x00,  // LED 3: None
-            0x00, 0x00, 0x00,  // LED 4: None
-            0x00, 0x00, 0x00,  // LED 5: None
-            0x00, 0x00, 0x00,  // LED 6: None
-            0x00, 0x00, 0x00,  // LED 7: None
-            0x00, 0x00, 0x00   // LED 8: None
-        };
-
+        int lit, alert_leds;
 
         // 寫入 LED
-        ws2812_send_from_kernel(rgb1, LED_COUNT * 3);
+        led_fill_pattern(0);
+        ws2812_send_from_kernel(led_buf, led_count);
         msleep(3000);
-        ws2812_send_from_kernel(reset, LED_COUNT * 3);
+        memset(led_buf, 0, led_count * 3);
+        ws2812_send_from_kernel(led_buf, led_count);
         msleep(3000);
-        ws2812_send_from_kernel(rgb2, LED_COUNT * 3);
+        led_fill_pattern(1);
+        ws2812_send_from_kernel(led_buf, led_count);
         msleep(3000);
-        ws2812_send_from_kernel(reset, LED_COUNT * 3);
+        memset(led_buf, 0, led_count * 3);
+        ws2812_send_from_kernel(led_buf, led_count);
         msleep(3000);
 
+        // 綠燈/紅燈的分界，依燈條長度等比例放大
+        alert_leds = ALERT_LEVEL * led_count / LED_LEVELS;
+
 
         while (!kthread_should_stop()) {
+            ktime_t start = ktime_get();
+
             usleep_range(290, 350);
+            ads1115_jitter_add(&led_jitter, ktime_us_delta(ktime_get(), start) - 290);
             // 轉成絕對值（以基準點為準
             mutex_lock(&ads1115_lock);
             if (last_val == sound_val){
@@ -173,12 +419,8 @@
             mutex_lock(&ads1115_lock);
             diff_val = (sound_val > base_line)? sound_val - base_line : base_line - sound_val;
 
-            // 把範圍壓到1~8顆燈
-            sound_level = diff_val * LED_COUNT / max_line;
-            if (sound_level > 7) 
-                sound_level = 7;
-            //讓燈至少維持一盞燈，不讓他閃爍
-            sound_level = (sound_level == 0) ? last_led_count : sound_level;
+            // 把範圍壓到 1~8 級，讓燈至少維持一盞燈，不讓他閃爍
+            sound_level = sound_to_level(diff_val, max_line, last_led_count);
             last_led_count = sound_level;
             
             if (sound_level > ALERT_LEVEL){
@@ -190,28 +432,13 @@
             sound_val = base_line + diff_val;
             
             mutex_unlock(&ads1115_lock);
-            pr_info("[WS2812] 音量: %d default: %d max_line:%d → 顯示 %d 顆燈\n", sound_val, base_line, max_line, sound_level + 1);
             // 計算顯示燈數（sound_level）
-            for (int i = 0; i < LED_COUNT; i++) {
-                if (i < sound_level + 1) {
-                    if (i < ALERT_LEVEL){
-                        led_buf[i * 3 + 0] = 0x00; // R
-                        led_buf[i * 3 + 1] = 0xFF; // G
-                        led_buf[i * 3 + 2] = 0x00; // B
-                    } else {
-                        led_buf[i * 3 + 0] = 0xFF; // R
-                        led_buf[i * 3 + 1] = 0x00; // G
-                        led_buf[i * 3 + 2] = 0x00; // B
-                    }
-                } else {
-                    led_buf[i * 3 + 0] = 0x00;
-                    led_buf[i * 3 + 1] = 0x00;
-                    led_buf[i * 3 + 2] = 0x00;
-                }
-            }
+            lit = level_to_lit(sound_level, led_count);
+            pr_debug("[WS2812] 音量: %d default: %d max_line:%d → 顯示 %d 顆燈\n", sound_val, base_line, max_line, lit);
+            led_fill_bar(led_buf, led_count, lit, alert_leds);
 
-            // 寫入 LED
-            ws2812_send_from_kernel(led_buf, LED_COUNT * 3);
+            // 寫入 LED，ws2812 只會重送有變動的前段
+            ws2812_send_from_kernel(led_buf, led_count);
         }
         return 0;
     }
@@ -222,9 +449,10 @@
         int len;
 
         mutex_lock(&ads1115_lock);
-        len = snprintf(kbuf, sizeof(kbuf), "%d\n", latest_val);
+        len = ads1115_format_val(kbuf, sizeof(kbuf), latest_val);
         mutex_unlock(&ads1115_lock);
 
+        len = min_t(size_t, len, count); // 不能寫超過 user 的 buffer
         if (copy_to_user(buf, kbuf, len))
             return -EFAULT;
 
@@ -256,9 +484,10 @@
         int len;
 
         mutex_lock(&ads1115_lock);
-        len = snprintf(kbuf, sizeof(kbuf), "%d\n", alert_val);
+        len = ads1115_format_val(kbuf, sizeof(kbuf), alert_val);
         mutex_unlock(&ads1115_lock);
 
+        len = min_t(size_t, len, count); // 不能寫超過 user 的 buffer
         if (copy_to_user(buf, kbuf, len))
             return -EFAULT;
 
@@ -325,6 +554,206 @@
         .mode = 0666,
     };
 
+    /* ---- IIO 介面：/sys/bus/iio/devices/iio:deviceN ---- */
+    static const struct iio_chan_spec ads1115_iio_channels[] = {
+        {
+            .type = IIO_VOLTAGE,
+            .indexed = 1,
+            .channel = 0,
+            .info_mask_separate = BIT(IIO_CHAN_INFO_RAW) | BIT(IIO_CHAN_INFO_SCALE),
+            .info_mask_shared_by_all = BIT(IIO_CHAN_INFO_SAMP_FREQ),
+            .info_mask_shared_by_all_available = BIT(IIO_CHAN_INFO_SAMP_FREQ),
+            .scan_index = 0,
+            .scan_type = {
+                .sign = 's',
+                .realbits = 16,
+                .storagebits = 16,
+                .endianness = IIO_CPU,
+            },
+        },
+        IIO_CHAN_SOFT_TIMESTAMP(1),
+    };
+
+    static int ads1115_iio_read_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan,
+                                    int *val, int *val2, long mask)
+    {
+        switch (mask) {
+        case IIO_CHAN_INFO_RAW:
+            mutex_lock(&ads1115_lock);
+            *val = (s16)latest_val;
+            mutex_unlock(&ads1115_lock);
+            return IIO_VAL_INT;
+        case IIO_CHAN_INFO_SCALE:
+            // PGA +/-2.048V：2048 mV / 2^15
+            *val = 2048;
+            *val2 = 15;
+            return IIO_VAL_FRACTIONAL_LOG2;
+        case IIO_CHAN_INFO_SAMP_FREQ:
+            mutex_lock(&ads1115_lock);
+            *val = ads1115_data_rate[ads1115_dr];
+            mutex_unlock(&ads1115_lock);
+            return IIO_VAL_INT;
+        default:
+            return -EINVAL;
+        }
+    }
+
+    static int ads1115_iio_read_avail(struct iio_dev *indio_dev, struct iio_chan_spec const *chan,
+                                      const int **vals, int *type, int *length, long mask)
+    {
+        if (mask != IIO_CHAN_INFO_SAMP_FREQ)
+            return -EINVAL;
+        *vals = ads1115_data_rate;
+        *type = IIO_VAL_INT;
+        *length = ARRAY_SIZE(ads1115_data_rate);
+        return IIO_AVAIL_LIST;
+    }
+
+    static int ads1115_iio_write_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan,
+                                     int val, int val2, long mask)
+    {
+        if (mask != IIO_CHAN_INFO_SAMP_FREQ)
+            return -EINVAL;
+        for (int i = 0; i < ARRAY_SIZE(ads1115_data_rate); i++) {
+            if (ads1115_data_rate[i] == val) {
+                mutex_lock(&ads1115_lock);
+                ads1115_dr = i;
+                cur_dr = i;
+                mutex_unlock(&ads1115_lock);
+                return 0;
+            }
+        }
+        return -EINVAL;
+    }
+
+    static const struct iio_info ads1115_iio_info = {
+        .read_raw = ads1115_iio_read_raw,
+        .read_avail = ads1115_iio_read_avail,
+        .write_raw = ads1115_iio_write_raw,
+        .validate_trigger = iio_validate_own_trigger,
+    };
+
+    static const struct iio_trigger_ops ads1115_trigger_ops = {
+    };
+
+    /* 由 poll thread 透過 iio_trigger_poll_nested() 呼叫，把最新一筆放進 kfifo */
+    static irqreturn_t ads1115_trigger_handler(int irq, void *p)
+    {
+        struct iio_poll_func *pf = p;
+        struct iio_dev *indio_dev = pf->indio_dev;
+        struct {
+            s16 chan;
+            s64 ts __aligned(8);
+        } scan;
+        s64 ts;
+
+        memset(&scan, 0, sizeof(scan));
+        mutex_lock(&ads1115_lock);
+        scan.chan = iio_sample;
+        ts = iio_sample_ts;
+        mutex_unlock(&ads1115_lock);
+
+        iio_push_to_buffers_with_timestamp(indio_dev, &scan, ts);
+        iio_trigger_notify_done(indio_dev->trig);
+        return IRQ_HANDLED;
+    }
+
+    static int ads1115_iio_setup(struct device *dev)
+    {
+        struct iio_dev *indio_dev;
+        int ret;
+
+        indio_dev = devm_iio_device_alloc(dev, 0);
+        if (!indio_dev)
+            return -ENOMEM;
+
+        indio_dev->name = DEVICE_NAME;
+        indio_dev->info = &ads1115_iio_info;
+        indio_dev->modes = INDIO_DIRECT_MODE;
+        indio_dev->channels = ads1115_iio_channels;
+        indio_dev->num_channels = ARRAY_SIZE(ads1115_iio_channels);
+
+        ads1115_trig = devm_iio_trigger_alloc(dev, "%s-dev%d", indio_dev->name, iio_device_id(indio_dev));
+        if (!ads1115_trig)
+            return -ENOMEM;
+        ads1115_trig->ops = &ads1115_trigger_ops;
+        iio_trigger_set_drvdata(ads1115_trig, indio_dev);
+        ret = devm_iio_trigger_register(dev, ads1115_trig);
+        if (ret)
+            return ret;
+        indio_dev->trig = iio_trigger_get(ads1115_trig);
+
+        // 預設 kfifo buffer，由 poll thread 每完成一次轉換觸發一次
+        ret = devm_iio_triggered_buffer_setup(dev, indio_dev, NULL, ads1115_trigger_handler, NULL);
+        if (ret)
+            return ret;
+
+        ret = devm_iio_device_register(dev, indio_dev);
+        if (ret)
+            return ret;
+
+        ads1115_indio = indio_dev;
+        return 0;
+    }
+
+    /* ---- 統計資料：/sys/devices/platform/<node>/ 下的唯讀檔案 ---- */
+    static u32 jitter_avg(const struct ads1115_jitter *j) {
+        return j->count ? div_u64(j->sum_us, j->count) : 0;
+    }
+
+    #define ADS1115_STAT_ATTR(_name, _expr)                                                     \
+        static ssize_t _name##_show(struct device *dev, struct device_attribute *attr, char *buf) \
+        {                                                                                       \
+            u32 val;                                                                            \
+                                                                                                \
+            spin_lock(&ads1115_stats_lock);                                                     \
+            val = (_expr);                                                                      \
+            spin_unlock(&ads1115_stats_lock);                                                   \
+            return sysfs_emit(buf, "%u\n", val);                                                \
+        }                                                                                       \
+        static DEVICE_ATTR_RO(_name)
+
+    ADS1115_STAT_ATTR(rate_changes, rate_changes);
+    ADS1115_STAT_ATTR(poll_jitter_avg_us, jitter_avg(&poll_jitter));
+    ADS1115_STAT_ATTR(poll_jitter_max_us, poll_jitter.max_us);
+    ADS1115_STAT_ATTR(led_jitter_avg_us, jitter_avg(&led_jitter));
+    ADS1115_STAT_ATTR(led_jitter_max_us, led_jitter.max_us);
+
+    static ssize_t sample_rate_show(struct device *dev, struct device_attribute *attr, char *buf)
+    {
+        int rate;
+
+        mutex_lock(&ads1115_lock);
+        rate = ads1115_data_rate[cur_dr];
+        mutex_unlock(&ads1115_lock);
+        return sysfs_emit(buf, "%d\n", rate);
+    }
+    static DEVICE_ATTR_RO(sample_rate);
+
+    /* 寫任何值都會把 jitter 與 rate_changes 歸零 */
+    static ssize_t reset_stats_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len)
+    {
+        spin_lock(&ads1115_stats_lock);
+        memset(&poll_jitter, 0, sizeof(poll_jitter));
+        memset(&led_jitter, 0, sizeof(led_jitter));
+        rate_changes = 0;
+        spin_unlock(&ads1115_stats_lock);
+        return len;
+    }
+    static DEVICE_ATTR_WO(reset_stats);
+
+    static struct attribute *ads1115_attrs[] = {
+        &dev_attr_sample_rate.attr,
+        &dev_attr_rate_changes.attr,
+        &dev_attr_poll_jitter_avg_us.attr,
+        &dev_attr_poll_jitter_max_us.attr,
+        &dev_attr_led_jitter_avg_us.attr,
+        &dev_attr_led_jitter_max_us.attr,
+        &dev_attr_reset_stats.attr,
+        NULL,
+    };
+    ATTRIBUTE_GROUPS(ads1115);
+
     static const struct of_device_id ads1115_ws2812_of_match[] = {
         { .compatible = "ads1115_ws2812", },
     };
@@ -341,7 +770,13 @@
 
         // 不要自己 i2c_get_adapter / i2c_new_client_device！DTS已經裝好了
 
-        led_buf = kzalloc(LED_COUNT * 3, GFP_KERNEL);
+        // 燈條長度由 ws2812 driver 從 DTS 讀出，它還沒 probe 就晚點再來
+        led_count = ws2812_get_led_count();
+        if (led_count <= 0)
+            return -EPROBE_DEFER;
+
+        // 跟著 device 釋放，probe 後面任何一步失敗都不會漏掉
+        led_buf = devm_kzalloc(dev, led_count * 3, GFP_KERNEL);
         if (!led_buf){
             dev_err(dev, "Failed to allocate led_buf\n");
             return -ENOMEM;
@@ -365,29 +800,40 @@
 
         ads1115_client = client;
 
-        poll_thread = kthread_run(ads1115_poll_fn, NULL, "ads1115_poll");
+        ret = ads1115_iio_setup(dev);
+        if (ret) {
+            dev_err(dev, "Failed to register IIO device\n");
+            return ret;
+        }
+
+        poll_thread = ads1115_thread_run(ads1115_poll_fn, "ads1115_poll");
         if (IS_ERR(poll_thread)) {
             dev_err(dev, "Failed to create poll thread\n");
-            return PTR_ERR(poll_thread);
+            ret = PTR_ERR(poll_thread);
+            poll_thread = NULL;
+            return ret;
         }
+        ret = devm_add_action_or_reset(dev, ads1115_thread_stop, &poll_thread);
+        if (ret)
+            return ret;
 
-        led_thread = kthread_run(led_thread_fn, NULL, "ws2812_led_updater");
+        led_thread = ads1115_thread_run(led_thread_fn, "ws2812_led_updater");
         if (IS_ERR(led_thread)) {
             dev_err(dev, "Failed to create ws2812_led_updater thread\n");
-            return PTR_ERR(led_thread);
+            ret = PTR_ERR(led_thread);
+            led_thread = NULL;
+            return ret;
         }
+        ret = devm_add_action_or_reset(dev, ads1115_thread_stop, &led_thread);
+        if (ret)
+            return ret;
 
         ret = misc_register(&ads1115_misc);
-        if (ret) {
-            kthread_stop(poll_thread);
-            kthread_stop(led_thread);
+        if (ret)
             return ret;
-        }
         ret = misc_register(&ads1115_alert_misc);
         if (ret) {
             misc_deregister(&ads1115_misc);
-            kthread_stop(poll_thread);
-            kthread_stop(led_thread);
             return ret;
         }
 
@@ -396,20 +842,16 @@
     }
 
     static void ads1115_ws2812_remove(struct platform_device *pdev) {
-        if (poll_thread)
-            kthread_stop(poll_thread);
-
-        if (led_thread)
-            kthread_stop(led_thread);
+        // 要在清掉 ads1115_client 與 led_buf 之前停，之後 devm action 看到 NULL 就不會再停一次
+        ads1115_thread_stop(&poll_thread);
+        ads1115_thread_stop(&led_thread);
 
         //這邊不要移除ads1115_client，這樣重開程式後能繼續使用
         //i2c_unregister_device(ads1115_client);
         ads1115_client = NULL;
 
-        if (led_buf) {
-            kfree(led_buf);
-            led_buf = NULL;
-        }
+        // led_buf 由 devm 釋放
+        led_buf = NULL;
 
         misc_deregister(&ads1115_misc);
         misc_deregister(&ads1115_alert_misc);
@@ -424,6 +866,7 @@
         .driver = {
             .name = DRIVER_NAME,
             .of_match_table = ads1115_ws2812_of_match,
+            .dev_groups = ads1115_groups,
         },
         .probe = ads1115_ws2812_probe,
         .remove = ads1115_ws2812_remove
@@ -434,3 +877,7 @@
     MODULE_LICENSE("GPL");
     MODULE_AUTHOR("JayLiao");
     MODULE_DESCRIPTION("Sound monitor");
+
+    #ifdef MEME_KUNIT
+    #include "ads1115_kunit.c"
+    #endif
@@ -0,0 +1,60 @@
+#!/bin/bash
+#
+# 在 UML (User Mode Linux) 裡跑 KUnit 測試，不需要開發板，也不會動到目前跑的 kernel。
+#   KERNEL_SRC=~/linux ./kunit_uml.sh
+# 1. 用 kunit.py 依 .kunitconfig 編出 UML kernel (放在 BUILD_DIR)
+# 2. 用這個 kernel 編出測試版模組 (make kunit DIR=... ARCH=um)
+# 3. 以唯讀的 hostfs 當 root 開機，init 載入模組後印出 debugfs 的 TAP 結果再關機
+# 有任何 not ok 或沒有結果就回傳失敗
+
+set -e
+
+MODULE_DIR="$(cd "$(dirname "$0")" && pwd)"
+KERNEL_SRC="${KERNEL_SRC:?請設定 KERNEL_SRC 為 Linux 原始碼目錄}"
+BUILD_DIR="${BUILD_DIR:-$MODULE_DIR/.kunit-uml}"
+JOBS="${JOBS:-$(nproc)}"
+LOG="$BUILD_DIR/kunit.log"
+
+mkdir -p "$BUILD_DIR"
+BUILD_DIR="$(cd "$BUILD_DIR" && pwd)"
+
+# UML 沒有 IOMEM，SPI 要靠 virtio PCI 才能選；hostfs 與 sysrq 是開機測試用的
+python3 "$KERNEL_SRC/tools/testing/kunit/kunit.py" build \
+    --arch=um --build_dir="$BUILD_DIR" --jobs="$JOBS" \
+    --kunitconfig="$MODULE_DIR/.kunitconfig" \
+    --kconfig_add CONFIG_UML_PCI_OVER_VIRTIO=y \
+    --kconfig_add CONFIG_UML_PCI_OVER_VIRTIO_DEVICE_ID=0 \
+    --kconfig_add CONFIG_VIRTIO_UML=y \
+    --kconfig_add CONFIG_HOSTFS=y \
+    --kconfig_add CONFIG_MAGIC_SYSRQ=y
+
+make -C "$MODULE_DIR" kunit DIR="$BUILD_DIR" ARCH=um
+
+cat > "$BUILD_DIR/init.sh" <<INIT
+#!/bin/sh
+mount -t proc proc /proc
+mount -t sysfs sysfs /sys
+mount -t debugfs debugfs /sys/kernel/debug
+insmod $MODULE_DIR/meme-ws2812.ko
+insmod $MODULE_DIR/ads1115_overlay.ko
+echo "=== KUNIT RESULTS ==="
+cat /sys/kernel/debug/kunit/meme-ws2812/results /sys/kernel/debug/kunit/ads1115/results
+echo "=== KUNIT END ==="
+echo o > /proc/sysrq-trigger
+INIT
+chmod +x "$BUILD_DIR/init.sh"
+
+"$BUILD_DIR/linux" mem=256M con0=null,fd:1 con=null \
+    root=/dev/root rootfstype=hostfs rootflags=/ ro init="$BUILD_DIR/init.sh" < /dev/null | tee "$LOG"
+
+sed -n '/=== KUNIT RESULTS ===/,/=== KUNIT END ===/p' "$LOG" > "$BUILD_DIR/results.tap"
+# 每個 suite 最後一行是不縮排的 ok/not ok，兩個 suite 都要有
+if [ "$(grep -cE "^(not )?ok" "$BUILD_DIR/results.tap")" -ne 2 ]; then
+    echo "沒有拿到測試結果，請看 $LOG"
+    exit 1
+fi
+if grep -q "not ok" "$BUILD_DIR/results.tap"; then
+    echo "有測試失敗，請看 $BUILD_DIR/results.tap"
+    exit 1
+fi
+echo "KUnit 全部通過"
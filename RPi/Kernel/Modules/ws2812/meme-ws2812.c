@@ -4,6 +4,16 @@
 #include <linux/fs.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/of.h>
+#include <linux/property.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "meme-ws2812.h"
 
 #define DRIVER_NAME "meme-ws2812"
 #define DEVICE_NAME "ws2812"
@@ -12,98 +22,284 @@
 #define WS2812_BITS_PER_COLOR (8 * 3)  // 每個顏色 8bit，每 bit 模擬 3bit
 #define WS2812_BITS_PER_LED (3 * WS2812_BITS_PER_COLOR) // G R B 各一組
 #define WS2812_SPI_BYTES_PER_LED (WS2812_BITS_PER_LED / 8) // = 72 bits / 8 = 9 bytes
+#define WS2812_SPI_HZ 2400000
+#define WS2812_DEFAULT_LED_COUNT 8
+#define WS2812_MAX_LED_COUNT 65536 // 編碼後 576KiB，2.4MHz 下整條刷新約 2 秒，再長就沒有意義了
+#define WS2812_CHUNK_BYTES 4096 // 每個 spi_transfer 最多送多少 byte，讓 DMA 不需要大塊連續記憶體
+#define WS2812_RESET_US 300 // 新版 WS2812B 需要 >280us 低電位才會 latch
+#define WS2812_RESET_BYTES DIV_ROUND_UP(WS2812_RESET_US * (WS2812_SPI_HZ / 8 / 1000), 1000)
 
 static struct spi_device *ws2812_spi;
+static DEFINE_MUTEX(ws2812_lock);
+static u32 ws2812_led_count;
+static u8 *ws2812_frame;        // 上一次送出去的 RGB，用來找出變動的範圍
+static bool ws2812_frame_valid; // 燈條狀態未知時(剛 probe)要整條重送
+static u8 *ws2812_spi_buf;      // 常駐的 SPI 編碼緩衝區，每顆 LED 9 byte，長燈條時用 vmalloc
+static u8 *ws2812_reset_buf;    // reset 用的 0，要能 DMA 所以不用 static 陣列
+static struct spi_transfer *ws2812_xfers;
+static int ws2812_xfer_count;
+
+/* mmap 用的常駐 framebuffer，commit 時才編碼送出 */
+static u8 *ws2812_fb;
+static size_t ws2812_fb_size;
+static atomic64_t ws2812_done_seq = ATOMIC64_INIT(0); // 已送完的 frame 數
+static DECLARE_WAIT_QUEUE_HEAD(ws2812_wq);
+
+static void ws2812_commit_fn(struct work_struct *work);
+static DECLARE_WORK(ws2812_commit_work, ws2812_commit_fn);
 
-void ws2812_send_from_kernel(const u8 *rgb, int count);
+struct ws2812_file {
+    u64 seen_seq; // 這個 fd 上次讀到的 frame 序號
+};
+
+/*
+ * 每個 color bit 模擬成 3 個 SPI bit (1 = 110, 0 = 100)，一個 color byte 剛好是 3 個 SPI byte。
+ * 24 bit 裡固定是 100 100 ... (0x924924)，color bit i (MSB 先送) 只決定第 3*i+1 個 bit，
+ * 所以 256 種 byte 的編碼在編譯期就能展開成常數表，不依賴 probe 先跑過。
+ */
+#define WS2812_ENC(b) (0x924924u | (((b) & 0x01u) << 1) | (((b) & 0x02u) << 3) | \
+                       (((b) & 0x04u) << 5) | (((b) & 0x08u) << 7) | (((b) & 0x10u) << 9) | \
+                       (((b) & 0x20u) << 11) | (((b) & 0x40u) << 13) | (((b) & 0x80u) << 15))
+#define WS2812_LUT1(b) { (WS2812_ENC(b) >> 16) & 0xFF, (WS2812_ENC(b) >> 8) & 0xFF, WS2812_ENC(b) & 0xFF }
+#define WS2812_LUT4(b) WS2812_LUT1(b), WS2812_LUT1((b) + 1), WS2812_LUT1((b) + 2), WS2812_LUT1((b) + 3)
+#define WS2812_LUT16(b) WS2812_LUT4(b), WS2812_LUT4((b) + 4), WS2812_LUT4((b) + 8), WS2812_LUT4((b) + 12)
+#define WS2812_LUT64(b) WS2812_LUT16(b), WS2812_LUT16((b) + 16), WS2812_LUT16((b) + 32), WS2812_LUT16((b) + 48)
 
-/* 模擬每個 byte（8bit），每 bit 轉為 3bit 模擬值 (110 或 100) , 共展開24bit*/
-static void ws2812_encode_byte(u8 byte, u8 *out)
+static const u8 ws2812_lut[256][3] = {
+    WS2812_LUT64(0), WS2812_LUT64(64), WS2812_LUT64(128), WS2812_LUT64(192)
+};
+
+/* 一顆 LED (GRB 24bit) 剛好編成 9 個 SPI byte，所以每顆 LED 可以單獨重編 */
+static void ws2812_encode_led(const u8 *rgb, u8 *out)
 {
-    for (int i = 7; i >= 0; i--) {
-        if (byte & (1 << i))
-            *out++ = 0b110;  // 邏輯 1
-        else
-            *out++ = 0b100;  // 邏輯 0
+    memcpy(out, ws2812_lut[rgb[1]], 3);     // G
+    memcpy(out + 3, ws2812_lut[rgb[0]], 3); // R
+    memcpy(out + 6, ws2812_lut[rgb[2]], 3); // B
+}
+
+/* 送出 spi_buf 前 len byte 再加上 reset 低電位，切成多個 transfer 放在同一個 message */
+static int ws2812_send_spi(size_t len)
+{
+    struct spi_message m;
+    struct spi_transfer *t;
+    size_t off = 0;
+    int n = 0;
+
+    spi_message_init(&m);
+    while (off < len && n < ws2812_xfer_count - 1) {
+        t = &ws2812_xfers[n++];
+        memset(t, 0, sizeof(*t));
+        t->tx_buf = ws2812_spi_buf + off;
+        t->len = min_t(size_t, len - off, WS2812_CHUNK_BYTES);
+        spi_message_add_tail(t, &m);
+        off += t->len;
     }
+
+    t = &ws2812_xfers[n];
+    memset(t, 0, sizeof(*t));
+    t->tx_buf = ws2812_reset_buf;
+    t->len = WS2812_RESET_BYTES;
+    spi_message_add_tail(t, &m);
+
+    return spi_sync(ws2812_spi, &m);
 }
 
-/* 將 bit array（每 bit 是 3bits 模擬）打包為 SPI 傳送用的 8-bit 格式 */
-static void ws2812_pack_bits(const u8 *in, int in_len, u8 *out)
+/* 呼叫時必須持有 ws2812_lock，且 ws2812_spi 不為 NULL */
+static void ws2812_send_locked(const u8 *rgb, int count)
 {
-    int bit_pos = 0;
-    memset(out, 0, (in_len * 3 + 7) / 8);
-
-    for (int i = 0; i < in_len; i++) {
-        for (int j = 2; j >= 0; j--) {
-            int bit = (in[i] >> j) & 1;
-            int byte_pos = bit_pos / 8;
-            int bit_offset = 7 - (bit_pos % 8);
-            if (bit)
-                out[byte_pos] |= (1 << bit_offset);
-            bit_pos++;
+    int last = -1;
+
+    if (count <= 0)
+        return;
+    if (count > (int)ws2812_led_count)
+        count = ws2812_led_count;
+
+    for (int i = 0; i < count; i++) {
+        if (ws2812_frame_valid && !memcmp(&ws2812_frame[i * 3], &rgb[i * 3], 3))
+            continue;
+        last = i;
+        // 從 ws2812_frame 編碼，rgb 可能是 user 正在改的 mmap framebuffer
+        memcpy(&ws2812_frame[i * 3], &rgb[i * 3], 3);
+        ws2812_encode_led(&ws2812_frame[i * 3], &ws2812_spi_buf[i * WS2812_SPI_BYTES_PER_LED]);
+    }
+
+    /*
+     * WS2812 是移位串接：前 N 顆吃掉前 N*24 bit 後就 latch，後面的燈維持原狀。
+     * 所以只要送到最後一顆有變動的 LED 為止，沒變動就不用送。
+     */
+    if (last >= 0) {
+        // 第一次送要整條刷新，count 之後的燈送黑色
+        if (!ws2812_frame_valid)
+            last = ws2812_led_count - 1;
+        // 送失敗時燈條狀態未知，下一張要整條重送
+        if (ws2812_send_spi((last + 1) * WS2812_SPI_BYTES_PER_LED)) {
+            pr_warn_ratelimited("ws2812: SPI transfer failed, full refresh on next frame\n");
+            ws2812_frame_valid = false;
+        } else {
+            ws2812_frame_valid = true;
         }
     }
 }
 
 void ws2812_send_from_kernel(const u8 *rgb, int count)
 {
-    int bits_len = count * 24;
-    u8 *tmp_bits = kzalloc(bits_len, GFP_KERNEL);
-    u8 *spi_buf = kzalloc(count * WS2812_SPI_BYTES_PER_LED, GFP_KERNEL);
-    u8 *p = tmp_bits;
-    
-    if (!tmp_bits || !spi_buf) {
-        pr_err("ws2812: memory alloc failed\n");
-        goto cleanup;
-    }
+    mutex_lock(&ws2812_lock);
+    if (ws2812_spi)
+        ws2812_send_locked(rgb, count);
+    mutex_unlock(&ws2812_lock);
+}
+EXPORT_SYMBOL(ws2812_send_from_kernel);
 
-    for (int i = 0; i < count; i++) {
-        ws2812_encode_byte(rgb[i * 3 + 1], p); p += 8; // G
-        ws2812_encode_byte(rgb[i * 3 + 0], p); p += 8; // R
-        ws2812_encode_byte(rgb[i * 3 + 2], p); p += 8; // B
+int ws2812_get_led_count(void)
+{
+    return ws2812_spi ? ws2812_led_count : 0;
+}
+EXPORT_SYMBOL(ws2812_get_led_count);
+
+/*
+ * ws2812_spi 與 framebuffer 都在 ws2812_lock 內檢查與使用：
+ * remove 時先在鎖內把 ws2812_spi 設成 NULL，之後就不會再有人碰 framebuffer 或排 commit。
+ */
+static void ws2812_commit_fn(struct work_struct *work)
+{
+    mutex_lock(&ws2812_lock);
+    if (!ws2812_spi) {
+        mutex_unlock(&ws2812_lock);
+        return;
     }
+    ws2812_send_locked(ws2812_fb, ws2812_led_count);
+    mutex_unlock(&ws2812_lock);
+    atomic64_inc(&ws2812_done_seq);
+    wake_up_interruptible(&ws2812_wq);
+}
 
-    ws2812_pack_bits(tmp_bits, bits_len, spi_buf);
+static int ws2812_open(struct inode *inode, struct file *file)
+{
+    struct ws2812_file *wf = kzalloc(sizeof(*wf), GFP_KERNEL);
 
-    struct spi_transfer t = {
-        .tx_buf = spi_buf,
-        .len = count * WS2812_SPI_BYTES_PER_LED,
-        .cs_change = 0,
-    };
-    struct spi_message m;
-    spi_message_init(&m);
-    spi_message_add_tail(&t, &m);
-    spi_sync(ws2812_spi, &m);
-cleanup:
-    kfree(tmp_bits);
-    kfree(spi_buf);
+    if (!wf)
+        return -ENOMEM;
+    wf->seen_seq = atomic64_read(&ws2812_done_seq);
+    file->private_data = wf;
+    return 0;
+}
+
+static int ws2812_release(struct inode *inode, struct file *file)
+{
+    kfree(file->private_data);
+    return 0;
 }
-EXPORT_SYMBOL(ws2812_send_from_kernel);
 
+/* 寫入的 RGB 直接放進 framebuffer 前段再同步送出，不用每次配置記憶體 */
 static ssize_t ws2812_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
 {
-    if (count % 3 != 0)
+    mutex_lock(&ws2812_lock);
+    if (!ws2812_spi) {
+        mutex_unlock(&ws2812_lock);
+        return -ENODEV;
+    }
+    if (count % 3 != 0 || count / 3 > (size_t)ws2812_led_count) {
+        mutex_unlock(&ws2812_lock);
         return -EINVAL;
+    }
+    if (copy_from_user(ws2812_fb, buf, count)) {
+        mutex_unlock(&ws2812_lock);
+        return -EFAULT;
+    }
 
-    u8 *rgb = kmalloc(count, GFP_KERNEL);
-    if (!rgb)
-        return -ENOMEM;
+    pr_debug("ws2812: write %zu bytes (%zu LEDs)\n", count, count / 3);
+    ws2812_send_locked(ws2812_fb, count / 3);
+    mutex_unlock(&ws2812_lock);
+    atomic64_inc(&ws2812_done_seq);
+    wake_up_interruptible(&ws2812_wq);
+    return count;
+}
+
+/* 讀出目前已送完的 frame 序號 (u64)，沒有新的 frame 就等 */
+static ssize_t ws2812_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    struct ws2812_file *wf = file->private_data;
+    u64 seq;
+
+    if (count < sizeof(seq))
+        return -EINVAL;
+
+    if (file->f_flags & O_NONBLOCK) {
+        if (atomic64_read(&ws2812_done_seq) == wf->seen_seq)
+            return -EAGAIN;
+    } else if (wait_event_interruptible(ws2812_wq, atomic64_read(&ws2812_done_seq) != wf->seen_seq)) {
+        return -ERESTARTSYS;
+    }
 
-    if (copy_from_user(rgb, buf, count)) {
-        kfree(rgb);
+    seq = atomic64_read(&ws2812_done_seq);
+    if (copy_to_user(buf, &seq, sizeof(seq)))
         return -EFAULT;
+    wf->seen_seq = seq;
+    return sizeof(seq);
+}
+
+static __poll_t ws2812_poll(struct file *file, poll_table *wait)
+{
+    struct ws2812_file *wf = file->private_data;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM; // 隨時可以 commit
+
+    poll_wait(file, &ws2812_wq, wait);
+    if (atomic64_read(&ws2812_done_seq) != wf->seen_seq)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    return mask;
+}
+
+static long ws2812_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct ws2812_info info;
+
+    switch (cmd) {
+    case WS2812_IOC_GET_INFO:
+        info.led_count = ws2812_led_count;
+        info.fb_size = ws2812_fb_size;
+        if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+            return -EFAULT;
+        return 0;
+    case WS2812_IOC_COMMIT:
+        // 還沒送的 commit 會合併成一次，送的是當下 framebuffer 的內容
+        mutex_lock(&ws2812_lock);
+        if (!ws2812_spi) {
+            mutex_unlock(&ws2812_lock);
+            return -ENODEV;
+        }
+        queue_work(system_highpri_wq, &ws2812_commit_work);
+        mutex_unlock(&ws2812_lock);
+        if (!(file->f_flags & O_NONBLOCK))
+            flush_work(&ws2812_commit_work);
+        return 0;
+    default:
+        return -ENOTTY;
     }
+}
 
-    pr_info("ws2812: write %zu bytes (%zu LEDs)\n", count, count / 3);
-    ws2812_send_from_kernel(rgb, count / 3);
-    kfree(rgb);
-    return count;
+static int ws2812_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    int ret = -ENODEV;
+
+    if (vma->vm_end - vma->vm_start > ws2812_fb_size)
+        return -EINVAL;
+    mutex_lock(&ws2812_lock);
+    if (ws2812_spi)
+        ret = remap_vmalloc_range(vma, ws2812_fb, vma->vm_pgoff);
+    mutex_unlock(&ws2812_lock);
+    return ret;
 }
 
 static const struct file_operations ws2812_fops = {
     .owner = THIS_MODULE,
+    .open = ws2812_open,
+    .release = ws2812_release,
+    .read = ws2812_read,
     .write = ws2812_write,
+    .poll = ws2812_poll,
+    .unlocked_ioctl = ws2812_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .mmap = ws2812_mmap,
 };
 
 static struct miscdevice ws2812_misc = {
@@ -127,29 +323,73 @@ MODULE_DEVICE_TABLE(of, ws2812_dt_ids);
 
 static int ws2812_probe(struct spi_device *spi)
 {
-    ws2812_spi = spi;
+    size_t spi_len;
+
+    if (device_property_read_u32(&spi->dev, "led-count", &ws2812_led_count) || !ws2812_led_count)
+        ws2812_led_count = WS2812_DEFAULT_LED_COUNT;
+    // 擋掉不合理的 led-count，避免下面的長度計算溢位配出太小的 buffer
+    if (ws2812_led_count > WS2812_MAX_LED_COUNT) {
+        dev_err(&spi->dev, "led-count %u exceeds the limit of %u\n", ws2812_led_count, WS2812_MAX_LED_COUNT);
+        ws2812_led_count = 0;
+        return -EINVAL;
+    }
+
+    spi_len = ws2812_led_count * WS2812_SPI_BYTES_PER_LED;
+    ws2812_xfer_count = DIV_ROUND_UP(spi_len, WS2812_CHUNK_BYTES) + 1; // 最後一個是 reset
+    ws2812_frame = kvzalloc(ws2812_led_count * 3, GFP_KERNEL);
+    // 不需要實體連續：SPI core 會把 vmalloc 的 buffer 逐頁 map 給 DMA
+    ws2812_spi_buf = kvzalloc(spi_len, GFP_KERNEL);
+    ws2812_reset_buf = kzalloc(WS2812_RESET_BYTES, GFP_KERNEL);
+    ws2812_xfers = kcalloc(ws2812_xfer_count, sizeof(*ws2812_xfers), GFP_KERNEL);
+    ws2812_fb_size = PAGE_ALIGN(ws2812_led_count * 3);
+    ws2812_fb = vmalloc_user(ws2812_fb_size);
+    if (!ws2812_frame || !ws2812_spi_buf || !ws2812_reset_buf || !ws2812_xfers || !ws2812_fb) {
+        kvfree(ws2812_frame);
+        kvfree(ws2812_spi_buf);
+        kfree(ws2812_reset_buf);
+        kfree(ws2812_xfers);
+        vfree(ws2812_fb);
+        ws2812_fb = NULL;
+        return -ENOMEM;
+    }
+    for (int i = 0; i < ws2812_led_count; i++)
+        ws2812_encode_led(&ws2812_frame[i * 3], &ws2812_spi_buf[i * WS2812_SPI_BYTES_PER_LED]);
+    ws2812_frame_valid = false;
+
     spi->mode = SPI_MODE_0;
-    spi->max_speed_hz = 2400000;
+    spi->max_speed_hz = WS2812_SPI_HZ;
     spi_setup(spi);
+    ws2812_spi = spi;
 
     misc_register(&ws2812_misc);
-    pr_info("ws2812: /dev/ws2812 created\n");
+    pr_info("ws2812: /dev/ws2812 created, %u LEDs, %d SPI chunk(s)\n", ws2812_led_count, ws2812_xfer_count - 1);
     return 0;
 }
 
 static void ws2812_remove(struct spi_device *spi)
 {
-    struct spi_message m;
-    u8 reset_buf[24] = { 0 };
-    struct spi_transfer reset_t = {
-        .tx_buf = reset_buf,
-        .len = sizeof(reset_buf),
-        .cs_change = 0,
-    };
-    spi_message_init(&m);
-    spi_message_add_tail(&reset_t, &m);
-    spi_sync(ws2812_spi, &m);
     misc_deregister(&ws2812_misc);
+
+    mutex_lock(&ws2812_lock);
+    // 只送 reset 低電位 (300us)，用可以 DMA 的 ws2812_reset_buf
+    ws2812_send_spi(0);
+    ws2812_spi = NULL;
+    mutex_unlock(&ws2812_lock);
+
+    // ws2812_spi 已經是 NULL，還開著的 fd 不能再排 commit，等正在跑的 work 結束
+    cancel_work_sync(&ws2812_commit_work);
+
+    mutex_lock(&ws2812_lock);
+    kvfree(ws2812_frame);
+    kvfree(ws2812_spi_buf);
+    kfree(ws2812_reset_buf);
+    kfree(ws2812_xfers);
+    ws2812_frame = ws2812_spi_buf = ws2812_reset_buf = NULL;
+    ws2812_xfers = NULL;
+    // 還被 mmap 住的 page 有自己的 refcount，這裡釋放不會影響 user
+    vfree(ws2812_fb);
+    ws2812_fb = NULL;
+    mutex_unlock(&ws2812_lock);
 }
 
 static struct spi_driver ws2812_driver = {
@@ -166,3 +406,7 @@ module_spi_driver(ws2812_driver);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("meme");
 MODULE_DESCRIPTION("SPI WS2812 driver with kernel-callable interface");
+
+#ifdef MEME_KUNIT
+#include "meme-ws2812_kunit.c"
+#endif
@@ -0,0 +1,32 @@
+#ifndef MEME_WS2812_H
+#define MEME_WS2812_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * /dev/ws2812 使用方式：
+ *   1. ioctl(WS2812_IOC_GET_INFO) 取得 LED 數量與 framebuffer 大小
+ *   2. mmap(fb_size) 取得常駐的 RGB framebuffer (每顆 LED 3 byte: R G B)
+ *   3. 畫完一張後 ioctl(WS2812_IOC_COMMIT) 送出
+ *      阻塞模式會等到送完才回來；O_NONBLOCK 只排進 workqueue，馬上返回
+ *   4. poll() 回 POLLIN 表示有新的一張送完了 (類似 vsync)，
+ *      read() 8 byte 取得目前已送完的 frame 序號
+ */
+
+struct ws2812_info {
+    __u32 led_count;
+    __u32 fb_size;    // mmap 時要用的長度 (已對齊 page)
+};
+
+#define WS2812_IOC_MAGIC 'W'
+#define WS2812_IOC_GET_INFO _IOR(WS2812_IOC_MAGIC, 0, struct ws2812_info)
+#define WS2812_IOC_COMMIT _IO(WS2812_IOC_MAGIC, 1)
+
+#ifdef __KERNEL__
+/* 給其他模組 (ads1115_overlay) 直接送燈用 */
+void ws2812_send_from_kernel(const u8 *rgb, int count);
+int ws2812_get_led_count(void);
+#endif
+
+#endif
@@ -0,0 +1,339 @@
+/*
+ * meme-ws2812 的 KUnit 測試，用 KUNIT=1 編譯時由 meme-ws2812.c 最後 include 進來，
+ * 所以可以直接測 static 的編碼表與送燈流程。
+ *
+ * SPI 端接的是假的 controller：transfer_one 只把送出的 byte 記下來，不碰硬體，
+ * 用來檢查只送變動前段、送失敗後整條重送，以及量測 driver 本身每秒能送幾張。
+ */
+#include <kunit/test.h>
+#include <linux/ktime.h>
+
+#define WS2812_KUNIT_LEDS 300
+#define WS2812_KUNIT_FRAMES 200
+
+/* WS2812B datasheet：T0H 0.4us、T1H 0.8us，誤差 ±150ns；reset 要 >280us */
+#define WS2812_T0H_NS 400
+#define WS2812_T1H_NS 800
+#define WS2812_TH_TOL_NS 150
+#define WS2812_RESET_MIN_US 280
+
+struct ws2812_fake_spi {
+    size_t len;    // 這次 message 送出的資料 byte 數 (不含 reset)
+    int resets;    // 收到幾次 reset，每個 message 最後都有一次
+    bool fail_next; // 下一個 transfer 回傳 -EIO
+    u8 data[WS2812_KUNIT_LEDS * WS2812_SPI_BYTES_PER_LED];
+};
+
+static const struct property_entry ws2812_kunit_props[] = {
+    PROPERTY_ENTRY_U32("led-count", WS2812_KUNIT_LEDS),
+    { }
+};
+
+static const struct software_node ws2812_kunit_swnode = {
+    .properties = ws2812_kunit_props,
+};
+
+static struct device *ws2812_kunit_parent;
+static struct spi_controller *ws2812_kunit_ctlr;
+static struct spi_device *ws2812_kunit_dev;
+static bool ws2812_kunit_busy; // 已經有真的燈條 probe 了，不能再接假的
+
+/* 需要假燈條的 case 呼叫，已經接了真的燈條就跳過 */
+static struct ws2812_fake_spi *ws2812_fake(struct kunit *test)
+{
+    if (ws2812_kunit_busy)
+        kunit_skip(test, "a real ws2812 strip is bound");
+    return spi_controller_get_devdata(ws2812_kunit_ctlr);
+}
+
+static int ws2812_fake_transfer_one(struct spi_controller *ctlr, struct spi_device *spi,
+                                    struct spi_transfer *t)
+{
+    struct ws2812_fake_spi *fake = spi_controller_get_devdata(ctlr);
+
+    if (fake->fail_next) {
+        fake->fail_next = false;
+        return -EIO;
+    }
+    if (t->tx_buf == ws2812_reset_buf) {
+        fake->resets++;
+        return 0;
+    }
+    if (fake->len + t->len <= sizeof(fake->data))
+        memcpy(fake->data + fake->len, t->tx_buf, t->len);
+    fake->len += t->len;
+    return 0;
+}
+
+/* 舊版逐 bit 打包的編碼，當作查表的對照組 */
+static void ws2812_kunit_encode_byte(u8 byte, u8 *out)
+{
+    u32 bits = 0;
+
+    for (int i = 7; i >= 0; i--)
+        bits = (bits << 3) | ((byte & (1 << i)) ? 0b110 : 0b100);
+
+    out[0] = bits >> 16;
+    out[1] = bits >> 8;
+    out[2] = bits;
+}
+
+static void ws2812_kunit_fill(u8 *rgb, int count, u8 r, u8 g, u8 b)
+{
+    for (int i = 0; i < count; i++) {
+        rgb[i * 3] = r;
+        rgb[i * 3 + 1] = g;
+        rgb[i * 3 + 2] = b;
+    }
+}
+
+static void ws2812_test_lut_known(struct kunit *test)
+{
+    static const u8 ff[3] = { 0xDB, 0x6D, 0xB6 };
+    static const u8 zero[3] = { 0x92, 0x49, 0x24 };
+    static const u8 aa[3] = { 0xD3, 0x4D, 0x34 };
+
+    KUNIT_EXPECT_MEMEQ(test, ws2812_lut[0xFF], ff, 3);
+    KUNIT_EXPECT_MEMEQ(test, ws2812_lut[0x00], zero, 3);
+    KUNIT_EXPECT_MEMEQ(test, ws2812_lut[0xAA], aa, 3);
+}
+
+static void ws2812_test_lut_reference(struct kunit *test)
+{
+    u8 ref[3];
+
+    for (int i = 0; i < 256; i++) {
+        ws2812_kunit_encode_byte(i, ref);
+        KUNIT_EXPECT_MEMEQ_MSG(test, ws2812_lut[i], ref, 3, "byte 0x%02x", i);
+    }
+}
+
+/* 從編碼表算出實際的高電位時間，確認 2.4MHz 下落在 datasheet 範圍內 */
+static void ws2812_test_lut_timing(struct kunit *test)
+{
+    u32 bit_ns = NSEC_PER_SEC / WS2812_SPI_HZ;
+    u32 t0h = hweight8(ws2812_lut[0x00][0] >> 5) * bit_ns; // 第一個 color bit 是最高 3 bit
+    u32 t1h = hweight8(ws2812_lut[0xFF][0] >> 5) * bit_ns;
+    u64 reset_ns = (u64)WS2812_RESET_BYTES * WS2812_BITS_PER_BYTE * NSEC_PER_SEC / WS2812_SPI_HZ;
+
+    KUNIT_EXPECT_GE(test, t0h, WS2812_T0H_NS - WS2812_TH_TOL_NS);
+    KUNIT_EXPECT_LE(test, t0h, WS2812_T0H_NS + WS2812_TH_TOL_NS);
+    KUNIT_EXPECT_GE(test, t1h, WS2812_T1H_NS - WS2812_TH_TOL_NS);
+    KUNIT_EXPECT_LE(test, t1h, WS2812_T1H_NS + WS2812_TH_TOL_NS);
+    KUNIT_EXPECT_GE(test, reset_ns, (u64)WS2812_RESET_MIN_US * NSEC_PER_USEC);
+}
+
+static void ws2812_test_encode_led_grb(struct kunit *test)
+{
+    static const u8 rgb[3] = { 0x12, 0x34, 0x56 };
+    u8 out[WS2812_SPI_BYTES_PER_LED];
+
+    ws2812_encode_led(rgb, out);
+    KUNIT_EXPECT_MEMEQ(test, out, ws2812_lut[0x34], 3);     // G
+    KUNIT_EXPECT_MEMEQ(test, out + 3, ws2812_lut[0x12], 3); // R
+    KUNIT_EXPECT_MEMEQ(test, out + 6, ws2812_lut[0x56], 3); // B
+}
+
+/* probe 後第一張就算只給兩顆，也要整條刷新，後面補黑色 */
+static void ws2812_test_first_frame_full(struct kunit *test)
+{
+    struct ws2812_fake_spi *fake = ws2812_fake(test);
+    static const u8 rgb[6] = { 0xFF, 0x00, 0x00, 0x00, 0x00, 0xFF };
+    u8 led[WS2812_SPI_BYTES_PER_LED];
+
+    ws2812_send_from_kernel(rgb, 2);
+    KUNIT_EXPECT_EQ(test, fake->resets, 1);
+    KUNIT_ASSERT_EQ(test, fake->len, (size_t)WS2812_KUNIT_LEDS * WS2812_SPI_BYTES_PER_LED);
+
+    ws2812_encode_led(rgb, led);
+    KUNIT_EXPECT_MEMEQ(test, fake->data, led, sizeof(led));
+    ws2812_encode_led(rgb + 3, led);
+    KUNIT_EXPECT_MEMEQ(test, fake->data + WS2812_SPI_BYTES_PER_LED, led, sizeof(led));
+    for (int i = 2; i < WS2812_KUNIT_LEDS; i++) {
+        for (int c = 0; c < 3; c++)
+            KUNIT_EXPECT_MEMEQ(test, fake->data + i * WS2812_SPI_BYTES_PER_LED + c * 3, ws2812_lut[0], 3);
+    }
+}
+
+/* 同一張不送，只改第 5 顆時送到第 5 顆為止 */
+static void ws2812_test_dirty_prefix(struct kunit *test)
+{
+    struct ws2812_fake_spi *fake = ws2812_fake(test);
+    u8 *rgb = kunit_kzalloc(test, WS2812_KUNIT_LEDS * 3, GFP_KERNEL);
+    u8 led[WS2812_SPI_BYTES_PER_LED];
+
+    KUNIT_ASSERT_NOT_NULL(test, rgb);
+    ws2812_kunit_fill(rgb, WS2812_KUNIT_LEDS, 0x00, 0xFF, 0x00);
+    ws2812_send_from_kernel(rgb, WS2812_KUNIT_LEDS);
+    KUNIT_ASSERT_EQ(test, fake->resets, 1);
+
+    fake->len = 0;
+    ws2812_send_from_kernel(rgb, WS2812_KUNIT_LEDS);
+    KUNIT_EXPECT_EQ(test, fake->resets, 1);
+    KUNIT_EXPECT_EQ(test, fake->len, (size_t)0);
+
+    rgb[4 * 3] = 0xFF;
+    ws2812_send_from_kernel(rgb, WS2812_KUNIT_LEDS);
+    KUNIT_EXPECT_EQ(test, fake->resets, 2);
+    KUNIT_ASSERT_EQ(test, fake->len, (size_t)5 * WS2812_SPI_BYTES_PER_LED);
+    ws2812_encode_led(&rgb[4 * 3], led);
+    KUNIT_EXPECT_MEMEQ(test, fake->data + 4 * WS2812_SPI_BYTES_PER_LED, led, sizeof(led));
+}
+
+/* SPI 送失敗後燈條狀態未知，下一張即使內容沒變也要整條重送 */
+static void ws2812_test_error_full_refresh(struct kunit *test)
+{
+    struct ws2812_fake_spi *fake = ws2812_fake(test);
+    u8 *rgb = kunit_kzalloc(test, WS2812_KUNIT_LEDS * 3, GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_NULL(test, rgb);
+    ws2812_send_from_kernel(rgb, WS2812_KUNIT_LEDS);
+
+    rgb[0] = 0xFF;
+    fake->fail_next = true;
+    fake->len = 0;
+    ws2812_send_from_kernel(rgb, WS2812_KUNIT_LEDS);
+    KUNIT_EXPECT_FALSE(test, ws2812_frame_valid);
+
+    fake->len = 0;
+    ws2812_send_from_kernel(rgb, WS2812_KUNIT_LEDS);
+    KUNIT_EXPECT_TRUE(test, ws2812_frame_valid);
+    KUNIT_EXPECT_EQ(test, fake->len, (size_t)WS2812_KUNIT_LEDS * WS2812_SPI_BYTES_PER_LED);
+}
+
+/*
+ * 整條燈每張都變的最壞情況，假 SPI 不花傳輸時間，量到的是 driver 編碼與 SPI core 的開銷。
+ * 這個值至少要比 2.4MHz 線路本身的上限高，燈條更新才不會卡在 CPU。
+ */
+static void ws2812_test_frame_rate(struct kunit *test)
+{
+    struct ws2812_fake_spi *fake = ws2812_fake(test);
+    u8 *a = kunit_kzalloc(test, WS2812_KUNIT_LEDS * 3, GFP_KERNEL);
+    u8 *b = kunit_kzalloc(test, WS2812_KUNIT_LEDS * 3, GFP_KERNEL);
+    u32 wire_fps = WS2812_SPI_HZ / ((WS2812_KUNIT_LEDS * WS2812_SPI_BYTES_PER_LED + WS2812_RESET_BYTES) *
+                                    WS2812_BITS_PER_BYTE);
+    ktime_t start;
+    u64 ns, fps;
+
+    KUNIT_ASSERT_NOT_NULL(test, a);
+    KUNIT_ASSERT_NOT_NULL(test, b);
+    ws2812_kunit_fill(a, WS2812_KUNIT_LEDS, 0xFF, 0x00, 0x00);
+    ws2812_kunit_fill(b, WS2812_KUNIT_LEDS, 0x00, 0x00, 0xFF);
+
+    start = ktime_get();
+    for (int i = 0; i < WS2812_KUNIT_FRAMES; i++)
+        ws2812_send_from_kernel(i & 1 ? b : a, WS2812_KUNIT_LEDS);
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    fps = div64_u64((u64)WS2812_KUNIT_FRAMES * NSEC_PER_SEC, max_t(u64, ns, 1));
+
+    KUNIT_EXPECT_EQ(test, fake->resets, WS2812_KUNIT_FRAMES);
+    kunit_info(test, "%d LEDs full refresh: %llu frames/s (wire limit %u frames/s)\n",
+               WS2812_KUNIT_LEDS, fps, wire_fps);
+    KUNIT_EXPECT_GE(test, fps, (u64)wire_fps);
+}
+
+static int ws2812_kunit_init(struct kunit *test)
+{
+    struct ws2812_fake_spi *fake;
+
+    if (ws2812_kunit_busy || !ws2812_kunit_ctlr)
+        return 0;
+
+    // 每個 case 都從 probe 後的狀態開始：燈條未知、計數歸零
+    mutex_lock(&ws2812_lock);
+    fake = spi_controller_get_devdata(ws2812_kunit_ctlr);
+    fake->len = 0;
+    fake->resets = 0;
+    fake->fail_next = false;
+    memset(ws2812_frame, 0, ws2812_led_count * 3);
+    ws2812_frame_valid = false;
+    mutex_unlock(&ws2812_lock);
+    return 0;
+}
+
+static int ws2812_kunit_suite_init(struct kunit_suite *suite)
+{
+    struct spi_board_info info = {
+        .modalias = "ws2812",
+        .max_speed_hz = WS2812_SPI_HZ,
+        .chip_select = 0,
+        .swnode = &ws2812_kunit_swnode,
+    };
+    int ret;
+
+    mutex_lock(&ws2812_lock);
+    ws2812_kunit_busy = ws2812_spi != NULL;
+    mutex_unlock(&ws2812_lock);
+    if (ws2812_kunit_busy)
+        return 0;
+
+    ws2812_kunit_parent = root_device_register("ws2812-kunit");
+    if (IS_ERR(ws2812_kunit_parent))
+        return PTR_ERR(ws2812_kunit_parent);
+
+    ws2812_kunit_ctlr = spi_alloc_host(ws2812_kunit_parent, sizeof(struct ws2812_fake_spi));
+    if (!ws2812_kunit_ctlr) {
+        ret = -ENOMEM;
+        goto err_parent;
+    }
+    ws2812_kunit_ctlr->bus_num = -1;
+    ws2812_kunit_ctlr->num_chipselect = 1;
+    ws2812_kunit_ctlr->mode_bits = SPI_MODE_0;
+    ws2812_kunit_ctlr->bits_per_word_mask = SPI_BPW_MASK(8);
+    ws2812_kunit_ctlr->transfer_one = ws2812_fake_transfer_one;
+    ret = spi_register_controller(ws2812_kunit_ctlr);
+    if (ret) {
+        spi_controller_put(ws2812_kunit_ctlr);
+        goto err_parent;
+    }
+
+    // 有 ws2812 的 id_table，加入 device 時就會同步 probe
+    ws2812_kunit_dev = spi_new_device(ws2812_kunit_ctlr, &info);
+    if (!ws2812_kunit_dev || ws2812_spi != ws2812_kunit_dev) {
+        ret = -ENODEV;
+        goto err_ctlr;
+    }
+    return 0;
+
+err_ctlr:
+    if (ws2812_kunit_dev)
+        spi_unregister_device(ws2812_kunit_dev);
+    ws2812_kunit_dev = NULL;
+    spi_unregister_controller(ws2812_kunit_ctlr);
+err_parent:
+    ws2812_kunit_ctlr = NULL;
+    root_device_unregister(ws2812_kunit_parent);
+    return ret;
+}
+
+static void ws2812_kunit_suite_exit(struct kunit_suite *suite)
+{
+    if (ws2812_kunit_busy || !ws2812_kunit_ctlr)
+        return;
+    spi_unregister_device(ws2812_kunit_dev);
+    spi_unregister_controller(ws2812_kunit_ctlr);
+    root_device_unregister(ws2812_kunit_parent);
+    ws2812_kunit_dev = NULL;
+    ws2812_kunit_ctlr = NULL;
+}
+
+static struct kunit_case ws2812_kunit_cases[] = {
+    KUNIT_CASE(ws2812_test_lut_known),
+    KUNIT_CASE(ws2812_test_lut_reference),
+    KUNIT_CASE(ws2812_test_lut_timing),
+    KUNIT_CASE(ws2812_test_encode_led_grb),
+    KUNIT_CASE(ws2812_test_first_frame_full),
+    KUNIT_CASE(ws2812_test_dirty_prefix),
+    KUNIT_CASE(ws2812_test_error_full_refresh),
+    KUNIT_CASE_SLOW(ws2812_test_frame_rate),
+    { }
+};
+
+static struct kunit_suite ws2812_kunit_suite = {
+    .name = "meme-ws2812",
+    .init = ws2812_kunit_init,
+    .suite_init = ws2812_kunit_suite_init,
+    .suite_exit = ws2812_kunit_suite_exit,
+    .test_cases = ws2812_kunit_cases,
+};
+kunit_test_suite(ws2812_kunit_suite);